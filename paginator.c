@@ -1,16 +1,30 @@
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xatom.h>
 #include <X11/Xresource.h>
 #include <X11/xpm.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/XShm.h>
 
 #include "x.xpm"
 
@@ -19,8 +33,21 @@
 #define MAX_VALUE       32767   /* 2^15-1 */
 #define ICON_SIZE       16
 #define ALLDESKTOPS     0xFFFFFFFF
+#define NOPOS           0xFFFFFFFF
 #define PAGER_ACTION    2
+#define NTILES          256     /* number of buckets of the tile cache */
+#define MAXUNUSED       64      /* number of unused tiles kept in cache */
+#define ATLASCOLS       16      /* number of icon slots per row of the atlas */
+#define MAXUNUSEDICONS  16      /* number of unused icons kept in the atlas */
+#define SHMICONS        64      /* number of icons in the shared memory arena */
+#define DISKICONS       256     /* number of icons in the disk cache */
+#define CLASSLEN        64      /* maximum length of a class in the disk cache */
+#define DISKMAGIC       "PGNICON1"
+#define NEWCLIENTS      32      /* number of clients added per iteration */
+#define MAXDEPTH        8       /* maximum depth of a client in the window tree */
 #define FLAG(f, b)      (((f) & (b)) == (b))
+#define SLOTX(s)        ((s) % ATLASCOLS * ICON_SIZE)
+#define SLOTY(s)        ((s) / ATLASCOLS * ICON_SIZE)
 
 #define ATOMS                            \
 	X(WM_DELETE_WINDOW)              \
@@ -39,6 +66,9 @@
 	X(_NET_WM_STATE_DEMANDS_ATTENTION)
 
 #define NCOLORS         17      /* number of color resources */
+#define NSCHEMES        4       /* number of color schemes */
+#define SCHEMESTRIDE    4       /* distance between two schemes (SCM_*) */
+#define SCHEMEINDEX(s)  ((s) / SCHEMESTRIDE)
 #define RESOURCES                                                                       \
 	/* ENUM             CLASS                NAME                         DEFAULT */\
 	/* color resources MUST be listed first; values are RGB channels              */\
@@ -64,8 +94,14 @@
 	X(RES_BORDER,       "BorderWidth",       "borderWidth",               1        )\
 	X(RES_SHADOW,       "ShadowThickness",   "shadowThickness",           1        )\
 	X(RES_SEPARATOR,    "SeparatorWidth",    "separatorWidth",            1        )\
+	/* numeric resources MUST be listed next; value is a number                   */\
+	X(RES_MOTION_RATE,  "MotionRate",        "motionRate",                60       )\
+	X(RES_ICON_INTERVAL,"IconInterval",      "iconInterval",              1000     )\
+	X(RES_RESIZE_RATE,  "ResizeRate",        "resizeRate",                10       )\
 	/* geometry resources; values are width and height in pixels                  */\
 	X(RES_GEOMETRY,     "Geometry",          "geometry",                  58       )\
+	/* rendering mode; value is ignored                                           */\
+	X(RES_RENDER_MODE,  "RenderMode",        "renderMode",                0        )\
 
 #define MOUSEEVENTMASK  (ButtonReleaseMask | PointerMotionMask)
 
@@ -91,6 +127,13 @@ enum Width {
 	NBORDERS,
 };
 
+enum Setting {
+	MOTION_RATE,                    /* maximum moves per second while dragging */
+	ICON_INTERVAL,                  /* minimum milliseconds between icon reloads */
+	RESIZE_RATE,                    /* maximum repaints per second while resized */
+	NSETTINGS,
+};
+
 enum Colors {
 	COLOR_BG     = 0,
 	COLOR_BOR    = 1,
@@ -104,6 +147,37 @@ enum Colors {
 	SCM_DESKTOP  = 12,
 };
 
+enum Dirty {
+	/* pending updates of the pager, deferred until the event queue drains */
+	DIRTY_RESOURCES = 1 << 0,       /* reload X resources */
+	DIRTY_NDESKTOPS = 1 << 1,       /* refetch number of desktops */
+	DIRTY_GEOMETRY  = 1 << 2,       /* recompute geometry of desktops and clients */
+	DIRTY_CLIENTS   = 1 << 3,       /* refetch list of clients */
+	DIRTY_ACTIVE    = 1 << 4,       /* refetch active window */
+	DIRTY_CURRDESK  = 1 << 5,       /* refetch current desktop */
+	DIRTY_SHOWDESK  = 1 << 6,       /* refetch "showing desktop" state */
+	DIRTY_PAGER     = 1 << 7,       /* redraw pager frame */
+	DIRTY_CLIENT    = 1 << 8,       /* at least one client is dirty */
+
+	/* pending updates of a client */
+	CLIENT_STATE    = 1 << 0,       /* refetch _NET_WM_STATE */
+	CLIENT_DESKTOP  = 1 << 1,       /* refetch _NET_WM_DESKTOP */
+	CLIENT_HINTS    = 1 << 2,       /* refetch WM_HINTS */
+	CLIENT_ICON     = 1 << 3,       /* refetch _NET_WM_ICON */
+	CLIENT_GEOMETRY = 1 << 4,       /* recompute geometry of miniatures */
+	CLIENT_DRAW     = 1 << 5,       /* redraw miniatures */
+	CLIENT_MAP      = 1 << 6,       /* remap miniatures */
+	CLIENT_FRAME    = 1 << 7,       /* refetch frame and geometry */
+	CLIENT_ACTIVE   = 1 << 8,       /* recheck scheme after (de)activation */
+};
+
+enum State {
+	/* relevant _NET_WM_STATE atoms, cached as a bitmask */
+	STATE_HIDDEN    = 1 << 0,
+	STATE_STICKY    = 1 << 1,
+	STATE_URGENT    = 1 << 2,
+};
+
 enum Orientation {
 	_NET_WM_ORIENTATION_HORZ = 0,
 	_NET_WM_ORIENTATION_VERT = 1,
@@ -132,26 +206,115 @@ typedef struct {
 typedef struct {
 	Window miniwin;
 	XRectangle geometry;
+	bool damaged;                   /* must be redrawn (composite mode) */
 } Desktop;
 
+typedef struct Icon Icon;
+struct Icon {
+	Icon           *next;
+
+	/* key */
+	char           *class;          /* WM_CLASS of the first client */
+	unsigned long   length;         /* size of its _NET_WM_ICON property */
+	uint32_t        hash;           /* hash of the pixels */
+	uint32_t        pixels[ICON_SIZE * ICON_SIZE];
+
+	int             slot;           /* slot in the atlas */
+	int             refs;
+	bool            live;           /* fetched from a client, not the disk */
+};
+
+typedef struct {
+	/* key */
+	char            class[CLASSLEN];        /* empty if the record is free */
+	uint32_t        length;
+	uint32_t        hash;
+
+	uint32_t        pixels[ICON_SIZE * ICON_SIZE];
+} DiskIcon;
+
+typedef struct {
+	char            magic[sizeof(DISKMAGIC)];
+	DiskIcon        icons[DISKICONS];
+} DiskCache;
+
+typedef struct {
+	Window          window;
+	char           *class;          /* NULL if unknown */
+	unsigned long   length;         /* size of _NET_WM_ICON; 0 if none */
+	bool            hasicon;
+	bool            stale;          /* taken from a cache, not fetched */
+	uint32_t        hash;
+	uint32_t        pixels[ICON_SIZE * ICON_SIZE];
+} IconFetch;
+
+typedef struct Tile Tile;
+struct Tile {
+	Tile           *next;           /* next tile on the same bucket */
+
+	/* key */
+	Icon           *icon;
+	int             scheme;
+	unsigned short  width, height;
+	unsigned int    generation;
+
+	Pixmap          pixmap;
+	Picture         picture;
+	int             refs;
+};
+
 typedef struct {
 	/* client window */
 	Window          clientwin;
 	XRectangle      clientgeom;
 
+	/*
+	 * The frame is the ancestor of the client window which is a child
+	 * of the root window.  The position of the client is the origin of
+	 * its frame plus its offset in the frame; both are maintained from
+	 * ConfigureNotify events alone.
+	 */
+	Window          frame;          /* None if not reparented */
+	int             framex, framey; /* origin of the frame */
+	int             offx, offy;     /* origin of the client in the frame */
+	int             relx, rely;     /* origin of the client in its parent */
+
 	/* miniature windows (one for each desktop) */
 	Window         *miniwins;
 	XRectangle     *minigeoms;
+	Tile          **tiles;
 
-	Picture         icon;
+	Icon           *icon;           /* NULL for the default icon */
+	unsigned long   iconreload;     /* time of the last icon reload */
+	unsigned long   lastresize;     /* time of the last resize of the miniatures */
 	Cardinal        desk;
+	int             states;
 	bool            ishidden;
 	bool            isurgent;
+
+	/*
+	 * Scheme, desktop and visibility the miniatures were last drawn
+	 * and mapped with; the miniatures are only redrawn or remapped
+	 * when those change.
+	 */
+	int             drawnscheme;
+	Cardinal        drawndesk;
+	bool            drawnhidden;
+
+	int             dirty;
+	Cardinal        pos;            /* position in the stacking list */
 } Client;
 
+typedef struct {
+	Window          window;
+	Client         *client;         /* NULL for desktop miniwindows */
+	Cardinal        desk;
+} Entry;
+
 typedef struct {
 	Display        *display;
 	bool            running;
+	int             dirty;
 
 	/* root window */
 	Window          root;
@@ -162,6 +325,7 @@ typedef struct {
 	XRectangle      geometry;
 	int             geomflags;
 	int             borders[NBORDERS];
+	int             settings[NSETTINGS];
 
 	/* graphics */
 	unsigned int    depth;
@@ -169,7 +333,78 @@ typedef struct {
 	Visual         *visual;
 	XRenderPictFormat *format, *formatARGB;
 	Color           colors[NCOLORS];
-	Picture         icon, mask;
+	Picture         frames[NSCHEMES];
+
+	/*
+	 * Client icons, shared by clients with the same icon, are packed
+	 * into the slots of a single ARGB atlas; slot 0 holds the default
+	 * icon.  The atlas grows and shrinks by rows of slots.
+	 */
+	Icon           *icons;          /* most recently used first */
+	Icon          **slots;          /* icon at each slot; NULL if free */
+	int             nslots, nicons, nunusedicons;
+	Pixmap          atlas;
+	Picture         atlaspic;
+	GC              atlasgc;
+
+	/*
+	 * On local displays, icons are uploaded through a shared memory
+	 * segment, used as a ring of SHMICONS staging cells.
+	 */
+	XShmSegmentInfo shminfo;
+	XImage         *shmimg;         /* NULL if no shared memory */
+	int             shmcell;
+
+	/* rendered miniatures, shared by every desktop and client */
+	Tile           *tiles[NTILES];
+	unsigned int    tilegen;
+	int             nunused;
+
+	/*
+	 * In composite mode, there are no desktop and client miniwindows;
+	 * the pager is drawn into a back buffer, which is copied into the
+	 * pager window once per frame.
+	 */
+	bool            composite;
+	bool            damaged;        /* some desktop must be redrawn */
+	bool            framedamaged;   /* the whole frame must be redrawn */
+	Pixmap          backbuf;
+	Picture         backpic;
+	GC              gc;
+	unsigned int    backw, backh;
+
+	/* last icon of each class, kept across restarts; NULL if none */
+	DiskCache      *diskcache;
+
+	/* icon worker; the display is NULL if there is no worker */
+	Display        *workerdpy;
+	pthread_t       worker;
+	int             reqfd[2], resfd[2];
+
+	int             nfetches;       /* icons queued for the worker */
+
+	/*
+	 * At startup, the pager and the desktops are drawn first, and the
+	 * clients are added NEWCLIENTS at a time, one batch per iteration
+	 * of the event loop.  With -stats, the times to the first frame
+	 * (the desktops, mapped by setup()) and to the last client and
+	 * icon are reported; they are taken from the start of setup(),
+	 * before connecting to the server, to after an XSync, so they
+	 * include the work of the server.
+	 */
+	bool            populating;     /* there are clients yet to be added */
+	bool            unstacked;      /* a restack was put off while populating */
+	bool            stats;
+	unsigned long   starttime, painttime, donetime;
+	unsigned long   nskipped;       /* client updates that drew nothing */
+
+	/* earliest time a deferred client update is due; 0 if none */
+	unsigned long   due;
+
+	/* client being dragged (composite mode) */
+	Client         *drag;
+	Cardinal        dragdesk;
+	int             dragx, dragy;
 
 	/* grid */
 	enum Orientation orient;
@@ -192,6 +427,10 @@ typedef struct {
 	Cardinal        nclients;
 	Client         *activeclient;
 	Client        **clients;
+
+	/* hash table indexing our windows and the client windows */
+	Entry          *entries;
+	size_t          nentries, maxentries;
 } Pager;
 
 static void
@@ -204,6 +443,20 @@ usage(void)
 	exit(EXIT_FAILURE);
 }
 
+static bool shmerror;
+static unsigned long shmserial;
+static XErrorHandler shmhandler;
+
+static int
+xerrorshm(Display *display, XErrorEvent *event)
+{
+	/* trap the error of XShmAttach only; pass any other along */
+	if (event->serial != shmserial)
+		return (*shmhandler)(display, event);
+	shmerror = true;
+	return 0;
+}
+
 static int
 xerror(Display *display, XErrorEvent *event)
 {
@@ -250,6 +503,17 @@ preparewin(Pager *pager, Window window)
 	XSelectInput(pager->display, window, StructureNotifyMask | PropertyChangeMask);
 }
 
+static unsigned long
+now(void)
+{
+	struct timespec ts;
+
+	/* return milliseconds from an arbitrary (but fixed) point in time */
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
 static int
 max(int x, int y)
 {
@@ -373,6 +637,42 @@ prealpha(uint32_t p)
 	return (rb & 0xFF00FFu) | (g & 0x00FF00u) | (a << 24u);
 }
 
+static void
+scaleicon(uint32_t *dst, const unsigned long *src, int w, int h)
+{
+	unsigned long a, r, g, b, n;
+	uint32_t pixel;
+	int x, y, x0, x1, y0, y1, i, j;
+
+	/*
+	 * Box-filter the icon down to ICON_SIZE x ICON_SIZE, narrowing and
+	 * premultiplying the pixels (which Xlib returns as longs, whatever
+	 * their format) on the fly, straight into the buffer of the image.
+	 * Each destination pixel is the average of a box of at least one
+	 * source pixel; a side shorter than ICON_SIZE is stretched.
+	 */
+	for (y = 0; y < ICON_SIZE; y++) {
+		y0 = y * h / ICON_SIZE;
+		y1 = max((y + 1) * h / ICON_SIZE, y0 + 1);
+		for (x = 0; x < ICON_SIZE; x++) {
+			x0 = x * w / ICON_SIZE;
+			x1 = max((x + 1) * w / ICON_SIZE, x0 + 1);
+			a = r = g = b = 0;
+			for (i = y0; i < y1; i++) {
+				for (j = x0; j < x1; j++) {
+					pixel = prealpha(src[i * w + j]);
+					a += (pixel >> 24u) & 0xFFu;
+					r += (pixel >> 16u) & 0xFFu;
+					g += (pixel >> 8u) & 0xFFu;
+					b += pixel & 0xFFu;
+				}
+			}
+			n = (x1 - x0) * (y1 - y0);
+			dst[y * ICON_SIZE + x] = (a / n) << 24u | (r / n) << 16u | (g / n) << 8u | (b / n);
+		}
+	}
+}
+
 static Cardinal
 getwinprop(Pager *pager, Window window, Atom prop, Window **wins)
 {
@@ -399,115 +699,101 @@ getwinprop(Pager *pager, Window window, Atom prop, Window **wins)
 	return len;
 }
 
-static Pixmap
-getewmhicon(Pager *pager, Window win, int *iconw, int *iconh, int *d)
+static bool
+getewmhicon(Display *display, Window win, Atom atom, uint32_t *pixels)
 {
-	XImage *img;
-	GC gc;
-	Pixmap pix = None;
 	Atom da;
-	size_t i, size;
-	uint32_t *data32;
-	unsigned long *q, *p, *end, *data = NULL;
-	unsigned long len, dl;
+	size_t size;
+	unsigned long *p, *data = NULL;
+	unsigned long len, dl, w, h;
+	long offset, iconoffset;
 	int diff, mindiff = INT_MAX;
-	int w, h;
+	int iconw, iconh;
 	int format;
-	char *datachr = NULL;
-
-	(void)d;
-	if (XGetWindowProperty(pager->display, win, pager->atoms[_NET_WM_ICON], 0L, UINT32_MAX, False, AnyPropertyType, &da, &format, &len, &dl, (unsigned char **)&q) != Success)
-		return None;
-	if (q == NULL)
-		return None;
-	if (len == 0 || format != 32)
-		goto done;
-	*iconw = *iconh = 0;
-	for (p = q, end = p + len; p < end; p += size) {
-		w = *p++;
-		h = *p++;
+	bool ret = false;
+
+	/*
+	 * _NET_WM_ICON can hold several large images.  Rather than getting
+	 * the whole property, walk through the headers of the images (two
+	 * longs: width and height) to select the smallest image not smaller
+	 * than ICON_SIZE, and then get the pixels of that image only.
+	 */
+	iconw = iconh = 0;
+	iconoffset = -1;
+	for (offset = 0; ; offset += 2 + size) {
+		p = NULL;
+		if (XGetWindowProperty(display, win, atom, offset, 2L, False, AnyPropertyType, &da, &format, &len, &dl, (unsigned char **)&p) != Success)
+			break;
+		if (p == NULL)
+			break;
+		w = h = 0;
+		if (format == 32 && len == 2) {
+			w = p[0];
+			h = p[1];
+		}
+		XFree(p);
+		if (w < 1 || h < 1 || w > MAX_VALUE || h > MAX_VALUE)
+			break;
 		size = w * h;
-		if (w < 1 || h < 1 || p + size > end)
+		if (size > dl / 4)      /* dl is the number of bytes left */
 			break;
 		diff = max(w, h) - ICON_SIZE;
 		if (diff >= 0 && diff < mindiff) {
-			*iconw = w;
-			*iconh = h;
-			data = p;
+			mindiff = diff;
+			iconw = w;
+			iconh = h;
+			iconoffset = offset + 2;
 			if (diff == 0) {
 				break;
 			}
 		}
+		if (size == dl / 4)
+			break;
 	}
+	if (iconoffset < 0)
+		return false;
+	size = iconw * iconh;
+	if (XGetWindowProperty(display, win, atom, iconoffset, size, False, AnyPropertyType, &da, &format, &len, &dl, (unsigned char **)&data) != Success)
+		return false;
 	if (data == NULL)
+		return false;
+	if (len != size || format != 32)
 		goto done;
-	size = *iconw * *iconh;
-	data32 = (uint32_t *)data;
-	for (i = 0; i < size; ++i)
-		data32[i] = prealpha(data[i]);
-	datachr = emalloc(size * sizeof(*data));
-	(void)memcpy(datachr, data32, size * sizeof(*data));
-	if ((img = XCreateImage(pager->display, pager->visual, 32, ZPixmap, 0, datachr, *iconw, *iconh, 32, 0)) == NULL) {
-		free(datachr);
-		goto done;
-	}
-	XInitImage(img);
-	pix = XCreatePixmap(pager->display, pager->root, *iconw, *iconh, 32);
-	gc = XCreateGC(pager->display, pix, 0, NULL);
-	XPutImage(pager->display, pix, gc, img, 0, 0, 0, 0, *iconw, *iconh);
-	XFreeGC(pager->display, gc);
-	XDestroyImage(img);
+
+	scaleicon(pixels, data, iconw, iconh);
+	ret = true;
 done:
-	XFree(q);
-	return pix;
+	XFree(data);
+	return ret;
 }
 
-static Picture
-geticonprop(Pager *pager, Window win)
+static int
+getstate(Pager *pager, Atom atom)
 {
-	Pixmap pix;
-	Picture pic = None;
-	XTransform xf;
-	int iconw, iconh;
-	int d;
-
-	if ((pix = getewmhicon(pager, win, &iconw, &iconh, &d)) == None)
-		return None;
-	if (pix == None)
-		return None;
-	pic = XRenderCreatePicture(pager->display, pix, pager->formatARGB, 0, NULL);
-	XFreePixmap(pager->display, pix);
-	if (pic == None)
-		return None;
-	if (max(iconw, iconh) != ICON_SIZE) {
-		XRenderSetPictureFilter(pager->display, pic, FilterBilinear, NULL, 0);
-		xf.matrix[0][0] = (iconw << 16u) / ICON_SIZE; xf.matrix[0][1] = 0; xf.matrix[0][2] = 0;
-		xf.matrix[1][0] = 0; xf.matrix[1][1] = (iconh << 16u) / ICON_SIZE; xf.matrix[1][2] = 0;
-		xf.matrix[2][0] = 0; xf.matrix[2][1] = 0; xf.matrix[2][2] = 65536;
-		XRenderSetPictureTransform(pager->display, pic, &xf);
-	}
-	return pic;
+	if (atom == pager->atoms[_NET_WM_STATE_HIDDEN])
+		return STATE_HIDDEN;
+	if (atom == pager->atoms[_NET_WM_STATE_STICKY])
+		return STATE_STICKY;
+	if (atom == pager->atoms[_NET_WM_STATE_DEMANDS_ATTENTION])
+		return STATE_URGENT;
+	return 0;
 }
 
-static bool
-hasstate(Pager *pager, Window window, Atom atom)
+static int
+getstates(Pager *pager, Window window)
 {
 	Atom *as;
 	Cardinal natoms, i;
-	int retval;
+	int states;
 
-	/* return non-zero if window has given state */
-	retval = 0;
+	/* fetch _NET_WM_STATE once and return the bitmask of relevant states */
+	states = 0;
 	if ((natoms = getatomprop(pager, window, pager->atoms[_NET_WM_STATE], &as)) != 0) {
-		for (i = 0; i < natoms; i++) {
-			if (as[i] == atom) {
-				retval = 1;
-				break;
-			}
-		}
+		for (i = 0; i < natoms; i++)
+			states |= getstate(pager, as[i]);
 		XFree(as);
 	}
-	return retval;
+	return states;
 }
 
 static bool
@@ -524,185 +810,1100 @@ isurgent(Pager *pager, Window win)
 	return ret;
 }
 
+static bool
+isatdesk(Client *cp, Cardinal desk)
+{
+	if (cp->ishidden)
+		return false;
+	if (cp->desk == ALLDESKTOPS)
+		return true;
+	return (cp->desk == desk);
+}
+
 static void
-cleanclient(Pager *pager, Client *client)
+damagedesktops(Pager *pager)
 {
 	Cardinal i;
 
-	if (client == NULL)
-		return;         /* can be set to NULL by setclients() */
 	for (i = 0; i < pager->ndesktops; i++)
-		XDestroyWindow(pager->display, client->miniwins[i]);
-	if (client->icon != None)
-		XRenderFreePicture(pager->display, client->icon);
-	free(client->miniwins);
-	free(client->minigeoms);
-	free(client);
+		pager->desktops[i].damaged = true;
+	pager->damaged = true;
 }
 
 static void
-cleandesktops(Pager *pager)
+damageclient(Pager *pager, Client *cp)
 {
 	Cardinal i;
 
+	/* damage the desktops the client is currently drawn on */
+	if (!pager->composite || pager->showingdesk || cp->drawnhidden)
+		return;
 	for (i = 0; i < pager->ndesktops; i++) {
-		XDestroyWindow(
-			pager->display,
-			pager->desktops[i].miniwin
-		);
+		if (cp->drawndesk == ALLDESKTOPS || cp->drawndesk == i) {
+			pager->desktops[i].damaged = true;
+			pager->damaged = true;
+		}
 	}
-	pager->ndesktops = 0;
-	free(pager->desktops);
+}
+
+static size_t
+hashwin(Window window, size_t size)
+{
+	/* fibonacci hashing; size must be a power of two */
+	return (size_t)(((uint64_t)window * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+static Entry *
+getentry(Pager *pager, Window window)
+{
+	size_t i;
+
+	if (pager->maxentries == 0 || window == None)
+		return NULL;
+	i = hashwin(window, pager->maxentries);
+	for (; pager->entries[i].window != None; i = (i + 1) & (pager->maxentries - 1))
+		if (pager->entries[i].window == window)
+			return &pager->entries[i];
+	return NULL;
 }
 
 static void
-cleanclients(Pager *pager)
+addentry(Pager *pager, Window window, Client *client, Cardinal desk)
 {
-	Cardinal i;
+	Entry *entries;
+	size_t i, j, maxentries;
 
-	for (i = 0; i < pager->nclients; i++)
-		cleanclient(pager, pager->clients[i]);
-	pager->nclients = 0;
-	pager->activeclient = NULL;
-	free(pager->clients);
+	if (window == None)
+		return;
+	if ((pager->nentries + 1) * 2 > pager->maxentries) {
+		/* keep the load factor below one half */
+		entries = pager->entries;
+		maxentries = pager->maxentries;
+		pager->maxentries = maxentries > 0 ? maxentries * 2 : 64;
+		pager->entries = ecalloc(pager->maxentries, sizeof(*pager->entries));
+		pager->nentries = 0;
+		for (j = 0; j < maxentries; j++) {
+			if (entries[j].window == None)
+				continue;
+			addentry(
+				pager,
+				entries[j].window,
+				entries[j].client,
+				entries[j].desk
+			);
+		}
+		free(entries);
+	}
+	i = hashwin(window, pager->maxentries);
+	while (pager->entries[i].window != None && pager->entries[i].window != window)
+		i = (i + 1) & (pager->maxentries - 1);
+	if (pager->entries[i].window == None)
+		pager->nentries++;
+	pager->entries[i] = (Entry){
+		.window = window,
+		.client = client,
+		.desk = desk,
+	};
 }
 
 static void
-drawshadows(Pager *pager, Picture picture, int scheme, XRectangle *geometry)
+delentry(Pager *pager, Window window)
 {
-	int i, w;
+	Entry *entry;
+	size_t i, j, k, mask;
 
-	if (scheme == SCM_DESKTOP)
-		w = pager->borders[FRAME_WIDTH];
-	else
-		w = pager->borders[SHADOW_WIDTH];
-	for(i = 0; i < w; i++) {
-		/* draw light shadow */
-		XRenderFillRectangle(
-			pager->display,
-			PictOpSrc,
-			picture,
-			&pager->colors[scheme + COLOR_TOP].channels,
-			i, i,
-			1, geometry->height - (i * 2 + 1)
-		);
-		XRenderFillRectangle(
-			pager->display,
-			PictOpSrc,
-			picture,
-			&pager->colors[scheme + COLOR_TOP].channels,
-			i, i,
-			geometry->width - (i * 2 + 1), 1
-		);
+	if ((entry = getentry(pager, window)) == NULL)
+		return;
 
-		/* draw dark shadow */
-		XRenderFillRectangle(
-			pager->display,
-			PictOpSrc,
-			picture,
-			&pager->colors[scheme + COLOR_BOT].channels,
-			geometry->width - 1 - i, i,
-			1, geometry->height - i * 2
-		);
-		XRenderFillRectangle(
-			pager->display,
-			PictOpSrc,
-			picture,
-			&pager->colors[scheme + COLOR_BOT].channels,
-			i, geometry->height - 1 - i,
-			geometry->width - i * 2, 1
-		);
+	/*
+	 * Linear probing without tombstones: shift back each following
+	 * entry of the cluster whose home slot is not cyclically in the
+	 * range (i, j], so no lookup ever stops at the emptied slot.
+	 */
+	mask = pager->maxentries - 1;
+	i = j = entry - pager->entries;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (pager->entries[j].window == None)
+			break;
+		k = hashwin(pager->entries[j].window, pager->maxentries);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		pager->entries[i] = pager->entries[j];
+		i = j;
 	}
+	pager->entries[i].window = None;
+	pager->nentries--;
+}
+
+static size_t
+hashtile(Icon *icon, int scheme, int w, int h)
+{
+	size_t hash;
+
+	hash = (uintptr_t)icon;
+	hash = hash * 31 + scheme;
+	hash = hash * 31 + w;
+	hash = hash * 31 + h;
+	return hash % NTILES;
 }
 
 static void
-drawclient(Pager *pager, Client *cp)
+freetile(Pager *pager, Tile *tile)
 {
-	Pixmap pixmap;
-	Picture picture, icon, mask;
-	Cardinal i, scheme;
+	Tile **tp;
 
-	if (cp->icon == None) {
-		icon = pager->icon;
-		mask = pager->mask;
-	} else {
-		icon = cp->icon;
-		mask = None;
+	for (tp = &pager->tiles[hashtile(tile->icon, tile->scheme, tile->width, tile->height)]; *tp != NULL; tp = &(*tp)->next) {
+		if (*tp == tile) {
+			*tp = tile->next;
+			break;
+		}
 	}
-	if (cp == pager->activeclient)
-		scheme = SCM_ACTIVE;
-	else if (cp->isurgent)
-		scheme = SCM_URGENT;
-	else
-		scheme = SCM_INACTIVE;
-	for (i = 0; i < pager->ndesktops; i++) {
-		pixmap = XCreatePixmap(
-			pager->display,
-			pager->window,
-			cp->minigeoms[i].width,
-			cp->minigeoms[i].height,
-			pager->depth
-		);
-		picture = XRenderCreatePicture(
-			pager->display,
-			pixmap,
-			pager->format,
-			0, NULL
-		);
-		XRenderFillRectangle(
-			pager->display,
-			PictOpSrc,
-			picture,
-			&pager->colors[scheme + COLOR_BG].channels,
-			0, 0,
-			cp->minigeoms[i].width,
-			cp->minigeoms[i].height
-		);
-		XRenderComposite(
-			pager->display,
-			PictOpOver,
-			icon, mask, picture,
-			0, 0, 0, 0,
-			(cp->minigeoms[i].width - ICON_SIZE) / 2,
-			(cp->minigeoms[i].height - ICON_SIZE) / 2,
-			ICON_SIZE, ICON_SIZE
-		);
-		drawshadows(pager, picture, scheme, &cp->minigeoms[i]);
-		XSetWindowBackgroundPixmap(
-			pager->display,
-			cp->miniwins[i],
-			pixmap
-		);
-		XSetWindowBorderPixmap(
-			pager->display,
-			cp->miniwins[i],
-			pager->colors[scheme + COLOR_BOR].pixmap
-		);
-		XClearWindow(pager->display, cp->miniwins[i]);
-		XRenderFreePicture(pager->display, picture);
-		XFreePixmap(pager->display, pixmap);
+	XRenderFreePicture(pager->display, tile->picture);
+	XFreePixmap(pager->display, tile->pixmap);
+	free(tile);
+}
+
+static void
+purgetiles(Pager *pager, bool all)
+{
+	Tile *tile, *next;
+	size_t i;
+
+	for (i = 0; i < NTILES; i++) {
+		for (tile = pager->tiles[i]; tile != NULL; tile = next) {
+			next = tile->next;
+			if (all || tile->refs == 0) {
+				freetile(pager, tile);
+			}
+		}
 	}
+	pager->nunused = 0;
 }
 
 static void
-drawpager(Pager *pager)
+puttile(Pager *pager, Tile *tile)
 {
-	Picture picture;
-	Pixmap pixmap;
+	if (tile == NULL || --tile->refs > 0)
+		return;
 
-	pixmap = XCreatePixmap(
-		pager->display,
-		pager->window,
-		pager->geometry.width,
-		pager->geometry.height,
-		pager->depth
-	);
-	picture = XRenderCreatePicture(
-		pager->display,
-		pixmap,
-		pager->format,
-		0, NULL
-	);
+	/*
+	 * Unused tiles are kept around (a client going back and forth
+	 * between active and inactive will need its tile again), until
+	 * there are too many of them.  Tiles from a previous generation
+	 * (drawn before the resources were reloaded) can go right away.
+	 */
+	if (tile->generation != pager->tilegen)
+		freetile(pager, tile);
+	else if (++pager->nunused > MAXUNUSED)
+		purgetiles(pager, false);
+}
+
+static char *
+getclass(Display *display, Window win)
+{
+	XClassHint classh = { 0 };
+	char *class;
+
+	if (!XGetClassHint(display, win, &classh))
+		return NULL;
+	class = NULL;
+	if (classh.res_class != NULL && (class = strdup(classh.res_class)) == NULL)
+		err(1, "strdup");
+	XFree(classh.res_name);
+	XFree(classh.res_class);
+	return class;
+}
+
+static unsigned long
+geticonlength(Display *display, Window win, Atom atom)
+{
+	Atom da;
+	unsigned char *p = NULL;
+	unsigned long len, dl;
+	int format;
+
+	/* get the size of _NET_WM_ICON, without any of its data */
+	if (XGetWindowProperty(display, win, atom, 0L, 0L, False, AnyPropertyType, &da, &format, &len, &dl, &p) != Success)
+		return 0;
+	XFree(p);
+	return dl;
+}
+
+static uint32_t
+hashicon(uint32_t *pixels)
+{
+	uint32_t hash;
+	size_t i;
+
+	/* FNV-1a */
+	hash = 2166136261u;
+	for (i = 0; i < ICON_SIZE * ICON_SIZE; i++)
+		hash = (hash ^ pixels[i]) * 16777619u;
+	return hash;
+}
+
+static void
+resizeatlas(Pager *pager, int nslots)
+{
+	Icon **slots;
+	Pixmap atlas;
+	int i;
+
+	atlas = XCreatePixmap(
+		pager->display,
+		pager->root,
+		ATLASCOLS * ICON_SIZE,
+		SLOTY(nslots),
+		32
+	);
+	if (pager->atlasgc == NULL) {
+		pager->atlasgc = XCreateGC(
+			pager->display,
+			atlas,
+			GCGraphicsExposures,
+			&(XGCValues){
+				.graphics_exposures = False,
+			}
+		);
+	}
+	slots = ecalloc(nslots, sizeof(*slots));
+	if (pager->atlas != None) {
+		XCopyArea(
+			pager->display,
+			pager->atlas,
+			atlas,
+			pager->atlasgc,
+			0, 0,
+			ATLASCOLS * ICON_SIZE,
+			SLOTY(nslots < pager->nslots ? nslots : pager->nslots),
+			0, 0
+		);
+		XRenderFreePicture(pager->display, pager->atlaspic);
+		XFreePixmap(pager->display, pager->atlas);
+	}
+	for (i = 0; i < nslots && i < pager->nslots; i++)
+		slots[i] = pager->slots[i];
+	free(pager->slots);
+	pager->slots = slots;
+	pager->nslots = nslots;
+	pager->atlas = atlas;
+	pager->atlaspic = XRenderCreatePicture(
+		pager->display,
+		atlas,
+		pager->formatARGB,
+		0, NULL
+	);
+}
+
+static void
+packatlas(Pager *pager)
+{
+	Icon *icon;
+	int slot, half;
+
+	/*
+	 * When no more than a quarter of the atlas is in use, move the
+	 * icons on its second half into the free slots of its first half,
+	 * and shrink it.  The rendered tiles do not refer to the atlas, so
+	 * they remain valid.
+	 */
+	half = pager->nslots / 2;
+	if (half < ATLASCOLS || (pager->nicons + 1) * 4 > pager->nslots)
+		return;
+	slot = 1;
+	for (icon = pager->icons; icon != NULL; icon = icon->next) {
+		if (icon->slot < half)
+			continue;
+		while (pager->slots[slot] != NULL)
+			slot++;
+		XCopyArea(
+			pager->display,
+			pager->atlas,
+			pager->atlas,
+			pager->atlasgc,
+			SLOTX(icon->slot), SLOTY(icon->slot),
+			ICON_SIZE, ICON_SIZE,
+			SLOTX(slot), SLOTY(slot)
+		);
+		pager->slots[icon->slot] = NULL;
+		pager->slots[slot] = icon;
+		icon->slot = slot;
+	}
+	resizeatlas(pager, half);
+}
+
+static int
+getslot(Pager *pager)
+{
+	int slot;
+
+	for (slot = 1; slot < pager->nslots; slot++)
+		if (pager->slots[slot] == NULL)
+			return slot;
+	slot = pager->nslots;
+	resizeatlas(pager, pager->nslots * 2);
+	return slot;
+}
+
+static void
+initshm(Pager *pager)
+{
+	XImage *img;
+
+	/*
+	 * The image is a column of SHMICONS cells, one for each upload
+	 * that may be in flight.  Attaching the segment fails on a remote
+	 * connection, even when the server supports the extension; then
+	 * icons are sent through the socket with XPutImage.
+	 */
+	if (!XShmQueryExtension(pager->display))
+		return;
+	img = XShmCreateImage(
+		pager->display,
+		pager->visual,
+		32,
+		ZPixmap,
+		NULL,
+		&pager->shminfo,
+		ICON_SIZE,
+		ICON_SIZE * SHMICONS
+	);
+	if (img == NULL)
+		return;
+	pager->shminfo.shmid = shmget(
+		IPC_PRIVATE,
+		img->bytes_per_line * img->height,
+		IPC_CREAT | 0600
+	);
+	if (pager->shminfo.shmid == -1) {
+		XDestroyImage(img);
+		return;
+	}
+	pager->shminfo.shmaddr = img->data = shmat(pager->shminfo.shmid, NULL, 0);
+	if (pager->shminfo.shmaddr == (char *)-1) {
+		(void)shmctl(pager->shminfo.shmid, IPC_RMID, NULL);
+		img->data = NULL;
+		XDestroyImage(img);
+		return;
+	}
+	pager->shminfo.readOnly = True;
+	XSync(pager->display, False);
+	shmerror = false;
+	shmhandler = XSetErrorHandler(xerrorshm);
+	shmserial = NextRequest(pager->display);
+	(void)XShmAttach(pager->display, &pager->shminfo);
+	XSync(pager->display, False);
+	(void)XSetErrorHandler(shmhandler);
+
+	/* the segment is destroyed once both sides have detached from it */
+	(void)shmctl(pager->shminfo.shmid, IPC_RMID, NULL);
+	if (shmerror) {
+		(void)shmdt(pager->shminfo.shmaddr);
+		img->data = NULL;
+		XDestroyImage(img);
+		return;
+	}
+	pager->shmimg = img;
+	pager->shmcell = 0;
+}
+
+static void
+cleanshm(Pager *pager)
+{
+	if (pager->shmimg == NULL)
+		return;
+	XShmDetach(pager->display, &pager->shminfo);
+	XSync(pager->display, False);
+	(void)shmdt(pager->shminfo.shmaddr);
+	pager->shmimg->data = NULL;
+	XDestroyImage(pager->shmimg);
+	pager->shmimg = NULL;
+}
+
+static bool
+uploadicon(Pager *pager, Icon *icon)
+{
+	XImage *img;
+	int y;
+
+	/* the icon is scaled down already, so its slot is only 1KiB */
+	if (pager->shmimg != NULL) {
+		/*
+		 * Before a cell is reused, the server must be done with
+		 * the previous upload from it.  Waiting once per lap of
+		 * the ring is enough, as requests are processed in order.
+		 */
+		if (pager->shmcell == SHMICONS) {
+			XSync(pager->display, False);
+			pager->shmcell = 0;
+		}
+		/* the server may pad the scanlines of the image */
+		for (y = 0; y < ICON_SIZE; y++)
+			memcpy(
+				pager->shmimg->data + (pager->shmcell * ICON_SIZE + y) * pager->shmimg->bytes_per_line,
+				icon->pixels + y * ICON_SIZE,
+				ICON_SIZE * sizeof(*icon->pixels)
+			);
+		XShmPutImage(
+			pager->display,
+			pager->atlas,
+			pager->atlasgc,
+			pager->shmimg,
+			0, pager->shmcell * ICON_SIZE,
+			SLOTX(icon->slot), SLOTY(icon->slot),
+			ICON_SIZE, ICON_SIZE,
+			False
+		);
+		pager->shmcell++;
+		return true;
+	}
+	if ((img = XCreateImage(pager->display, pager->visual, 32, ZPixmap, 0, (char *)icon->pixels, ICON_SIZE, ICON_SIZE, 32, 0)) == NULL)
+		return false;
+	XInitImage(img);
+	XPutImage(pager->display, pager->atlas, pager->atlasgc, img, 0, 0, SLOTX(icon->slot), SLOTY(icon->slot), ICON_SIZE, ICON_SIZE);
+	img->data = NULL;       /* the pixels belong to the icon */
+	XDestroyImage(img);
+	return true;
+}
+
+static void
+unlinkicon(Pager *pager, Icon *icon)
+{
+	Icon **ip;
+
+	for (ip = &pager->icons; *ip != NULL; ip = &(*ip)->next) {
+		if (*ip == icon) {
+			*ip = icon->next;
+			break;
+		}
+	}
+}
+
+static void
+evicticon(Pager *pager, Icon *icon)
+{
+	Tile *tile, *next;
+	size_t i;
+
+	/*
+	 * No client holds the icon, and so no client holds its tiles; but
+	 * unused tiles of the icon may still be in the cache, and must go
+	 * before a new icon gets the same address.
+	 */
+	for (i = 0; i < NTILES; i++) {
+		for (tile = pager->tiles[i]; tile != NULL; tile = next) {
+			next = tile->next;
+			if (tile->icon == icon) {
+				freetile(pager, tile);
+				pager->nunused--;
+			}
+		}
+	}
+	unlinkicon(pager, icon);
+	pager->slots[icon->slot] = NULL;
+	pager->nicons--;
+	pager->nunusedicons--;
+	free(icon->class);
+	free(icon);
+}
+
+static Icon *
+getunusedicon(Pager *pager)
+{
+	Icon *icon, *lru;
+
+	/* get the least recently used icon that no client holds */
+	lru = NULL;
+	for (icon = pager->icons; icon != NULL; icon = icon->next)
+		if (icon->refs == 0)
+			lru = icon;
+	return lru;
+}
+
+static Icon *
+useicon(Pager *pager, Icon *icon)
+{
+	if (icon->refs++ == 0)
+		pager->nunusedicons--;
+	unlinkicon(pager, icon);
+	icon->next = pager->icons;
+	pager->icons = icon;
+	return icon;
+}
+
+static void
+opendiskcache(Pager *pager)
+{
+	DiskCache *cache;
+	struct stat sb;
+	char path[PATH_MAX];
+	char *dir;
+	int fd, n;
+
+	/*
+	 * The disk cache is a fixed-size hash table of downscaled icons,
+	 * keyed by class, and mapped into memory.  It is only a hint: an
+	 * icon read from it is checked against the property of the client
+	 * later on, and each record carries the hash of its pixels.
+	 */
+	if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0')
+		n = snprintf(path, sizeof(path), "%s/%s", dir, APP_NAME);
+	else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0')
+		n = snprintf(path, sizeof(path), "%s/.cache/%s", dir, APP_NAME);
+	else
+		return;
+	if (n < 0 || (size_t)n >= sizeof(path) - sizeof("/icons"))
+		return;
+	if (mkdir(path, 0700) == -1 && errno == ENOENT) {
+		/* $HOME/.cache may not exist yet */
+		path[strrchr(path, '/') - path] = '\0';
+		(void)mkdir(path, 0700);
+		path[strlen(path)] = '/';
+		(void)mkdir(path, 0700);
+	}
+	(void)strcat(path, "/icons");
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1)
+		goto done;
+	if (sb.st_size != sizeof(*cache) && ftruncate(fd, 0) == -1)
+		goto done;
+	if (sb.st_size != sizeof(*cache) && ftruncate(fd, sizeof(*cache)) == -1)
+		goto done;
+	cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (cache == MAP_FAILED)
+		goto done;
+	if (memcmp(cache->magic, DISKMAGIC, sizeof(DISKMAGIC)) != 0) {
+		memset(cache, 0, sizeof(*cache));
+		memcpy(cache->magic, DISKMAGIC, sizeof(DISKMAGIC));
+	}
+	pager->diskcache = cache;
+done:
+	(void)close(fd);
+}
+
+static DiskIcon *
+getdiskicon(DiskCache *cache, const char *class)
+{
+	DiskIcon *rec;
+	uint32_t hash;
+	size_t home, i;
+
+	/* get the record of a class, or a free record for it */
+	if (cache == NULL || strlen(class) >= CLASSLEN)
+		return NULL;
+	hash = 2166136261u;
+	for (i = 0; class[i] != '\0'; i++)
+		hash = (hash ^ (unsigned char)class[i]) * 16777619u;
+	home = hash % DISKICONS;
+	for (i = 0; i < DISKICONS; i++) {
+		rec = &cache->icons[(home + i) % DISKICONS];
+		if (rec->class[0] == '\0' || strncmp(rec->class, class, CLASSLEN) == 0)
+			return rec;
+	}
+	return &cache->icons[home];
+}
+
+static void
+putdiskicon(Pager *pager, uint32_t *pixels, uint32_t hash, const char *class, unsigned long length)
+{
+	DiskIcon *rec;
+
+	if ((rec = getdiskicon(pager->diskcache, class)) == NULL)
+		return;
+	if (rec->hash == hash && rec->length == length && strcmp(rec->class, class) == 0)
+		return;
+	memcpy(rec->pixels, pixels, sizeof(rec->pixels));
+	rec->hash = hash;
+	rec->length = length;
+	(void)strcpy(rec->class, class);
+}
+
+static IconFetch *
+fetchicon(Pager *pager, Display *display, Window win)
+{
+	IconFetch *fetch;
+	Atom atom;
+
+	/*
+	 * Fetch, select, scale and premultiply the icon of a window.  This
+	 * runs on the worker thread, on its own connection, and only reads
+	 * the atoms of the pager; the caches belong to the main thread.
+	 */
+	atom = pager->atoms[_NET_WM_ICON];
+	fetch = ecalloc(1, sizeof(*fetch));
+	fetch->window = win;
+	if ((fetch->length = geticonlength(display, win, atom)) == 0)
+		return fetch;
+	fetch->class = getclass(display, win);
+	if (getewmhicon(display, win, atom, fetch->pixels)) {
+		fetch->hash = hashicon(fetch->pixels);
+		fetch->hasicon = true;
+	}
+	return fetch;
+}
+
+static Icon *
+findicon(Pager *pager, uint32_t *pixels, uint32_t hash, char *class, unsigned long length)
+{
+	Icon *icon;
+
+	/* look up the icon by its contents; add it if not cached */
+	if (class != NULL)
+		putdiskicon(pager, pixels, hash, class, length);
+	for (icon = pager->icons; icon != NULL; icon = icon->next) {
+		if (icon->hash != hash)
+			continue;
+		if (memcmp(icon->pixels, pixels, sizeof(icon->pixels)) != 0)
+			continue;
+		if (icon->class == NULL) {
+			icon->class = class;
+			icon->length = length;
+		} else {
+			free(class);
+		}
+		return useicon(pager, icon);
+	}
+
+	/* make room for the new icon by evicting an unused one, if any */
+	if (pager->nicons + 1 >= pager->nslots && (icon = getunusedicon(pager)) != NULL)
+		evicticon(pager, icon);
+	icon = emalloc(sizeof(*icon));
+	*icon = (Icon){
+		.next = pager->icons,
+		.class = class,
+		.length = length,
+		.hash = hash,
+		.slot = getslot(pager),
+		.refs = 1,
+	};
+	memcpy(icon->pixels, pixels, sizeof(icon->pixels));
+	if (!uploadicon(pager, icon)) {
+		free(class);
+		free(icon);
+		return NULL;
+	}
+	pager->slots[icon->slot] = icon;
+	pager->icons = icon;
+	pager->nicons++;
+	return icon;
+}
+
+static void
+puticon(Pager *pager, Icon *icon)
+{
+	if (icon == NULL || --icon->refs > 0)
+		return;
+
+	/*
+	 * Unused icons are kept around (the application may open another
+	 * window), until there are too many of them.
+	 */
+	if (++pager->nunusedicons <= MAXUNUSEDICONS)
+		return;
+	evicticon(pager, getunusedicon(pager));
+	packatlas(pager);
+}
+
+static void
+setframe(Pager *pager, Client *cp, Window frame)
+{
+	/* index the frame of a client, and listen to its configuration */
+	if (cp->frame != None) {
+		XSelectInput(pager->display, cp->frame, NoEventMask);
+		delentry(pager, cp->frame);
+	}
+	cp->frame = None;
+	if (frame == None || frame == cp->clientwin || getentry(pager, frame) != NULL)
+		return;
+	cp->frame = frame;
+	addentry(pager, frame, cp, 0);
+	XSelectInput(pager->display, frame, StructureNotifyMask);
+}
+
+static void
+cleanclient(Pager *pager, Client *client)
+{
+	Cardinal i;
+
+	if (client == NULL)
+		return;         /* can be set to NULL by setclients() */
+	damageclient(pager, client);
+	delentry(pager, client->clientwin);
+	setframe(pager, client, None);
+	for (i = 0; i < pager->ndesktops; i++) {
+		puttile(pager, client->tiles[i]);
+		if (client->miniwins[i] == None)
+			continue;
+		delentry(pager, client->miniwins[i]);
+		XDestroyWindow(pager->display, client->miniwins[i]);
+	}
+	puticon(pager, client->icon);
+	free(client->miniwins);
+	free(client->minigeoms);
+	free(client->tiles);
+	free(client);
+}
+
+static void
+cleandesktops(Pager *pager)
+{
+	Cardinal i;
+
+	for (i = 0; i < pager->ndesktops; i++) {
+		if (pager->desktops[i].miniwin == None)
+			continue;
+		delentry(pager, pager->desktops[i].miniwin);
+		XDestroyWindow(
+			pager->display,
+			pager->desktops[i].miniwin
+		);
+	}
+	pager->ndesktops = 0;
+	free(pager->desktops);
+}
+
+static void
+cleanclients(Pager *pager)
+{
+	Cardinal i;
+
+	for (i = 0; i < pager->nclients; i++)
+		cleanclient(pager, pager->clients[i]);
+	pager->nclients = 0;
+	pager->activeclient = NULL;
+	free(pager->clients);
+}
+
+static int
+getthickness(Pager *pager, int scheme)
+{
+	if (scheme == SCM_DESKTOP)
+		return pager->borders[FRAME_WIDTH];
+	return pager->borders[SHADOW_WIDTH];
+}
+
+static void
+drawshadowlines(Pager *pager, Picture picture, int scheme, XRectangle *geometry)
+{
+	int i, w, x, y;
+
+	w = getthickness(pager, scheme);
+	x = geometry->x;
+	y = geometry->y;
+	for(i = 0; i < w; i++) {
+		/* draw light shadow */
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			picture,
+			&pager->colors[scheme + COLOR_TOP].channels,
+			x + i, y + i,
+			1, geometry->height - (i * 2 + 1)
+		);
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			picture,
+			&pager->colors[scheme + COLOR_TOP].channels,
+			x + i, y + i,
+			geometry->width - (i * 2 + 1), 1
+		);
+
+		/* draw dark shadow */
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			picture,
+			&pager->colors[scheme + COLOR_BOT].channels,
+			x + geometry->width - 1 - i, y + i,
+			1, geometry->height - i * 2
+		);
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			picture,
+			&pager->colors[scheme + COLOR_BOT].channels,
+			x + i, y + geometry->height - 1 - i,
+			geometry->width - i * 2, 1
+		);
+	}
+}
+
+static void
+fillframes(Pager *pager)
+{
+	Pixmap pixmap;
+	int scheme, n;
+
+	/*
+	 * Render the shadows of each scheme into a nine-slice picture, a
+	 * square whose sides are twice the shadow thickness plus one; the
+	 * corners are copied from it, and the edges are plain fills.
+	 */
+	for (scheme = 0; scheme < NSCHEMES * SCHEMESTRIDE; scheme += SCHEMESTRIDE) {
+		if (pager->frames[SCHEMEINDEX(scheme)] != None)
+			XRenderFreePicture(pager->display, pager->frames[SCHEMEINDEX(scheme)]);
+		pager->frames[SCHEMEINDEX(scheme)] = None;
+		if ((n = getthickness(pager, scheme)) < 1)
+			continue;
+		n = n * 2 + 1;
+		pixmap = XCreatePixmap(
+			pager->display,
+			pager->window,
+			n, n,
+			pager->depth
+		);
+		pager->frames[SCHEMEINDEX(scheme)] = XRenderCreatePicture(
+			pager->display,
+			pixmap,
+			pager->format,
+			0, NULL
+		);
+		XFreePixmap(pager->display, pixmap);
+		drawshadowlines(
+			pager,
+			pager->frames[SCHEMEINDEX(scheme)],
+			scheme,
+			&(XRectangle){ .width = n, .height = n }
+		);
+	}
+}
+
+static void
+drawshadows(Pager *pager, Picture picture, int scheme, XRectangle *geometry)
+{
+	Picture frame;
+	int i, t, x, y, w, h;
+
+	t = getthickness(pager, scheme);
+	x = geometry->x;
+	y = geometry->y;
+	w = geometry->width;
+	h = geometry->height;
+	frame = pager->frames[SCHEMEINDEX(scheme)];
+	if (t < 1)
+		return;
+	if (frame == None || w < t * 2 || h < t * 2) {
+		/* too small for the corners; draw line by line */
+		drawshadowlines(pager, picture, scheme, geometry);
+		return;
+	}
+
+	/* edges, which are solid */
+	XRenderFillRectangles(
+		pager->display,
+		PictOpSrc,
+		picture,
+		&pager->colors[scheme + COLOR_TOP].channels,
+		(XRectangle[]){
+			{ x + t, y, w - t * 2, t },
+			{ x, y + t, t, h - t * 2 },
+		},
+		2
+	);
+	XRenderFillRectangles(
+		pager->display,
+		PictOpSrc,
+		picture,
+		&pager->colors[scheme + COLOR_BOT].channels,
+		(XRectangle[]){
+			{ x + t, y + h - t, w - t * 2, t },
+			{ x + w - t, y + t, t, h - t * 2 },
+		},
+		2
+	);
+
+	/* corners, copied from the nine-slice picture */
+	for (i = 0; i < 4; i++) {
+		XRenderComposite(
+			pager->display,
+			PictOpSrc,
+			frame, None, picture,
+			(i & 1) ? t + 1 : 0,
+			(i & 2) ? t + 1 : 0,
+			0, 0,
+			(i & 1) ? x + w - t : x,
+			(i & 2) ? y + h - t : y,
+			t, t
+		);
+	}
+}
+
+static int
+getscheme(Pager *pager, Client *cp)
+{
+	if (cp == pager->activeclient)
+		return SCM_ACTIVE;
+	if (cp->isurgent)
+		return SCM_URGENT;
+	return SCM_INACTIVE;
+}
+
+static void
+drawtile(Pager *pager, Picture picture, Icon *icon, int scheme, XRectangle *geometry)
+{
+	int slot;
+
+	/* draw the miniature of a client into the given rectangle */
+	slot = (icon != NULL) ? icon->slot : 0;
+	XRenderFillRectangle(
+		pager->display,
+		PictOpSrc,
+		picture,
+		&pager->colors[scheme + COLOR_BG].channels,
+		geometry->x, geometry->y,
+		geometry->width,
+		geometry->height
+	);
+	XRenderComposite(
+		pager->display,
+		PictOpOver,
+		pager->atlaspic, None, picture,
+		SLOTX(slot), SLOTY(slot), 0, 0,
+		geometry->x + (geometry->width - ICON_SIZE) / 2,
+		geometry->y + (geometry->height - ICON_SIZE) / 2,
+		ICON_SIZE, ICON_SIZE
+	);
+	drawshadows(pager, picture, scheme, geometry);
+}
+
+static Tile *
+gettile(Pager *pager, Icon *icon, int scheme, int w, int h)
+{
+	Tile *tile;
+	size_t i;
+
+	i = hashtile(icon, scheme, w, h);
+	for (tile = pager->tiles[i]; tile != NULL; tile = tile->next) {
+		if (tile->generation != pager->tilegen)
+			continue;
+		if (tile->icon != icon || tile->scheme != scheme)
+			continue;
+		if (tile->width != w || tile->height != h)
+			continue;
+		if (tile->refs++ == 0)
+			pager->nunused--;
+		return tile;
+	}
+	tile = emalloc(sizeof(*tile));
+	*tile = (Tile){
+		.next = pager->tiles[i],
+		.icon = icon,
+		.scheme = scheme,
+		.width = w,
+		.height = h,
+		.generation = pager->tilegen,
+		.refs = 1,
+	};
+	tile->pixmap = XCreatePixmap(
+		pager->display,
+		pager->window,
+		w, h,
+		pager->depth
+	);
+	tile->picture = XRenderCreatePicture(
+		pager->display,
+		tile->pixmap,
+		pager->format,
+		0, NULL
+	);
+	drawtile(pager, tile->picture, icon, scheme, &(XRectangle){
+		.width = w,
+		.height = h,
+	});
+	pager->tiles[i] = tile;
+	return tile;
+}
+
+static Tile *
+updatetile(Pager *pager, Client *cp, Cardinal desk)
+{
+	Tile *tile;
+	int scheme;
+
+	/*
+	 * Get the rendered miniature of a client on a desktop.  Since the
+	 * desktops have (nearly) the same size, the same tile is usually
+	 * shared by all the desktops a client is on, and by every client
+	 * with the same icon and scheme; it is rendered only once.
+	 */
+	scheme = getscheme(pager, cp);
+	tile = cp->tiles[desk];
+	if (tile != NULL &&
+	    tile->generation == pager->tilegen &&
+	    tile->icon == cp->icon &&
+	    tile->scheme == scheme &&
+	    tile->width == cp->minigeoms[desk].width &&
+	    tile->height == cp->minigeoms[desk].height)
+		return tile;
+	cp->tiles[desk] = gettile(
+		pager,
+		cp->icon,
+		scheme,
+		cp->minigeoms[desk].width,
+		cp->minigeoms[desk].height
+	);
+	puttile(pager, tile);
+	return cp->tiles[desk];
+}
+
+static void
+drawminiature(Pager *pager, Client *cp, Cardinal desk)
+{
+	Tile *tile;
+
+	if (cp->miniwins[desk] == None)
+		return;
+	tile = updatetile(pager, cp, desk);
+	XSetWindowBackgroundPixmap(
+		pager->display,
+		cp->miniwins[desk],
+		tile->pixmap
+	);
+	XSetWindowBorderPixmap(
+		pager->display,
+		cp->miniwins[desk],
+		pager->colors[tile->scheme + COLOR_BOR].pixmap
+	);
+	XClearWindow(pager->display, cp->miniwins[desk]);
+}
+
+static void
+drawclient(Pager *pager, Client *cp)
+{
+	Cardinal i;
+
+	for (i = 0; i < pager->ndesktops; i++) {
+		drawminiature(pager, cp, i);
+	}
+}
+
+static void
+drawpager(Pager *pager)
+{
+	Picture picture;
+	Pixmap pixmap;
+
+	if (pager->composite) {
+		pager->framedamaged = true;
+		pager->damaged = true;
+		return;
+	}
+	pixmap = XCreatePixmap(
+		pager->display,
+		pager->window,
+		pager->geometry.width,
+		pager->geometry.height,
+		pager->depth
+	);
+	picture = XRenderCreatePicture(
+		pager->display,
+		pixmap,
+		pager->format,
+		0, NULL
+	);
 	XRenderFillRectangle(
 		pager->display,
 		PictOpSrc,
@@ -712,7 +1913,10 @@ drawpager(Pager *pager)
 		pager->geometry.width,
 		pager->geometry.height
 	);
-	drawshadows(pager, picture, SCM_DESKTOP, &pager->geometry);
+	drawshadows(pager, picture, SCM_DESKTOP, &(XRectangle){
+		.width = pager->geometry.width,
+		.height = pager->geometry.height,
+	});
 	XSetWindowBackgroundPixmap(
 		pager->display,
 		pager->window,
@@ -723,24 +1927,211 @@ drawpager(Pager *pager)
 	XFreePixmap(pager->display, pixmap);
 }
 
+static void
+drawdesktop(Pager *pager, Cardinal desk)
+{
+	Pixmap pixmap;
+
+	if (desk >= pager->ndesktops)
+		return;
+	if (pager->composite) {
+		pager->desktops[desk].damaged = true;
+		pager->damaged = true;
+		return;
+	}
+	if (desk == pager->activedesktop)
+		pixmap = pager->colors[SCM_DESKTOP + COLOR_FG].pixmap;
+	else
+		pixmap = pager->colors[SCM_DESKTOP + COLOR_BG].pixmap;
+	XSetWindowBackgroundPixmap(
+		pager->display,
+		pager->desktops[desk].miniwin,
+		pixmap
+	);
+	XClearWindow(pager->display, pager->desktops[desk].miniwin);
+}
+
 static void
 drawdesktops(Pager *pager)
 {
 	Cardinal i;
-	Pixmap pixmap;
 
 	for (i = 0; i < pager->ndesktops; i++) {
+		drawdesktop(pager, i);
+	}
+}
+
+static void
+drawcomposite(Pager *pager, Client *cp, Cardinal desk, int x, int y)
+{
+	XRectangle *geometry;
+	int b;
+
+	/* draw a miniature and its border into the back buffer */
+	geometry = &cp->minigeoms[desk];
+	b = pager->borders[BORDER_WIDTH];
+	if (b > 0) {
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			pager->backpic,
+			&pager->colors[getscheme(pager, cp) + COLOR_BOR].channels,
+			x, y,
+			geometry->width + b * 2,
+			geometry->height + b * 2
+		);
+	}
+	XRenderComposite(
+		pager->display,
+		PictOpSrc,
+		updatetile(pager, cp, desk)->picture,
+		None,
+		pager->backpic,
+		0, 0, 0, 0,
+		x + b, y + b,
+		geometry->width,
+		geometry->height
+	);
+}
+
+static void
+drawframe(Pager *pager)
+{
+	XRectangle rect;
+	Client *cp;
+	Cardinal i, j;
+	int off, color;
+
+	/*
+	 * Redraw the damaged desktops into the back buffer, and copy them
+	 * into the pager window.  Each desktop is drawn with its clients,
+	 * from bottom to top, clipped to the desktop rectangle.
+	 */
+	if (!pager->composite || !pager->damaged)
+		return;
+	pager->damaged = false;
+	if (pager->backw != pager->geometry.width || pager->backh != pager->geometry.height) {
+		if (pager->backpic != None)
+			XRenderFreePicture(pager->display, pager->backpic);
+		if (pager->backbuf != None)
+			XFreePixmap(pager->display, pager->backbuf);
+		pager->backw = pager->geometry.width;
+		pager->backh = pager->geometry.height;
+		pager->backbuf = XCreatePixmap(
+			pager->display,
+			pager->window,
+			pager->backw,
+			pager->backh,
+			pager->depth
+		);
+		pager->backpic = XRenderCreatePicture(
+			pager->display,
+			pager->backbuf,
+			pager->format,
+			0, NULL
+		);
+		pager->framedamaged = true;
+	}
+	if (pager->framedamaged) {
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			pager->backpic,
+			&pager->colors[SCM_DESKTOP + COLOR_BOR].channels,
+			0, 0,
+			pager->backw,
+			pager->backh
+		);
+		drawshadows(pager, pager->backpic, SCM_DESKTOP, &(XRectangle){
+			.width = pager->backw,
+			.height = pager->backh,
+		});
+		for (i = 0; i < pager->ndesktops; i++) {
+			pager->desktops[i].damaged = true;
+		}
+	}
+	off = pager->borders[FRAME_WIDTH];
+	for (i = 0; i < pager->ndesktops; i++) {
+		if (!pager->desktops[i].damaged)
+			continue;
+		pager->desktops[i].damaged = false;
+		rect = pager->desktops[i].geometry;
+		rect.x += off;
+		rect.y += off;
 		if (i == pager->activedesktop)
-			pixmap = pager->colors[SCM_DESKTOP + COLOR_FG].pixmap;
+			color = SCM_DESKTOP + COLOR_FG;
 		else
-			pixmap = pager->colors[SCM_DESKTOP + COLOR_BG].pixmap;
-		XSetWindowBackgroundPixmap(
+			color = SCM_DESKTOP + COLOR_BG;
+		XRenderSetPictureClipRectangles(
 			pager->display,
-			pager->desktops[i].miniwin,
-			pixmap
+			pager->backpic,
+			0, 0,
+			&rect, 1
+		);
+		XRenderFillRectangle(
+			pager->display,
+			PictOpSrc,
+			pager->backpic,
+			&pager->colors[color].channels,
+			rect.x, rect.y,
+			rect.width, rect.height
+		);
+		for (j = 0; j < pager->nclients && !pager->showingdesk; j++) {
+			cp = pager->clients[j];
+			if (!isatdesk(cp, i))
+				continue;
+			if (cp == pager->drag && i == pager->dragdesk)
+				continue;
+			drawcomposite(
+				pager,
+				cp,
+				i,
+				rect.x + cp->minigeoms[i].x,
+				rect.y + cp->minigeoms[i].y
+			);
+		}
+		if (pager->drag != NULL) {
+			/* the dragged miniature is above everything else */
+			drawcomposite(
+				pager,
+				pager->drag,
+				pager->dragdesk,
+				pager->dragx,
+				pager->dragy
+			);
+		}
+		if (pager->framedamaged)
+			continue;
+		XCopyArea(
+			pager->display,
+			pager->backbuf,
+			pager->window,
+			pager->gc,
+			rect.x, rect.y,
+			rect.width, rect.height,
+			rect.x, rect.y
+		);
+	}
+	XRenderChangePicture(
+		pager->display,
+		pager->backpic,
+		CPClipMask,
+		&(XRenderPictureAttributes){
+			.clip_mask = None,
+		}
+	);
+	if (pager->framedamaged) {
+		XCopyArea(
+			pager->display,
+			pager->backbuf,
+			pager->window,
+			pager->gc,
+			0, 0,
+			pager->backw, pager->backh,
+			0, 0
 		);
-		XClearWindow(pager->display, pager->desktops[i].miniwin);
 	}
+	pager->framedamaged = false;
 }
 
 static void
@@ -790,6 +2181,8 @@ setdeskgeom(Pager *pager)
 		geometry->height = h * (y + 1) / pager->nrows - h * y / pager->nrows;
 		if (geometry->height < 1)
 			geometry->height = 1;
+		if (pager->desktops[i].miniwin == None)
+			continue;
 		XMoveResizeWindow(
 			pager->display,
 			pager->desktops[i].miniwin,
@@ -806,112 +2199,83 @@ unmapclient(Pager *pager, Client *cp)
 {
 	Cardinal i;
 
-	for (i = 0; i < pager->ndesktops; i++) {
-		XUnmapWindow(pager->display, cp->miniwins[i]);
-	}
-}
-
-static bool
-isatdesk(Client *cp, Cardinal desk)
-{
-	if (cp->ishidden)
-		return false;
-	if (cp->desk == ALLDESKTOPS)
-		return true;
-	return (cp->desk == desk);
-}
-
-static void
-mapclient(Pager *pager, Client *cp)
-{
-	Cardinal i;
-
-	for (i = 0; i < pager->ndesktops; i++) {
-		if (isatdesk(cp, i)) {
-			XMapWindow(pager->display, cp->miniwins[i]);
-		} else {
-			XUnmapWindow(pager->display, cp->miniwins[i]);
-		}
-	}
+	for (i = 0; i < pager->ndesktops; i++)
+		if (cp->miniwins[i] != None)
+			XUnmapWindow(pager->display, cp->miniwins[i]);
 }
 
-static void
-setclientgeometry(Pager *pager, Client *cp)
+static bool
+configureclient(Pager *pager, int desk, Client *cp, bool resize)
 {
-	Window dw;
-	unsigned int du, b;
-	int x, y;
-	int cx, cy;
-	unsigned int cw, ch;
+	XRectangle *dp, *mp;
+	int w, h;
+	bool resized;
 
-	XGetGeometry(
-		pager->display,
-		cp->clientwin,
-		&dw, &x, &y, &cw, &ch, &b, &du
-	);
-	XTranslateCoordinates(
-		pager->display,
-		cp->clientwin,
-		pager->root,
-		x, y, &cx, &cy, &dw
-	);
-	cp->clientgeom.x = cx;
-	cp->clientgeom.y = cy;
-	cp->clientgeom.width = cw;
-	cp->clientgeom.height = ch;
+	/*
+	 * Move the miniature of the client on the given desktop; and, if
+	 * resize is true, resize it too.  Return whether the size of the
+	 * miniature is (or, if not resized, should be) changed, in which
+	 * case it must be redrawn.
+	 */
+	dp = &pager->desktops[desk].geometry;
+	mp = &cp->minigeoms[desk];
+	mp->x = cp->clientgeom.x * dp->width / pager->rootgeom.width;
+	mp->y = cp->clientgeom.y * dp->height / pager->rootgeom.height;
+	w = max(cp->clientgeom.width * dp->width / pager->rootgeom.width, 1);
+	h = max(cp->clientgeom.height * dp->height / pager->rootgeom.height, 1);
+	resized = (w != mp->width || h != mp->height);
+	if (resized && resize) {
+		mp->width = w;
+		mp->height = h;
+	}
+	if (cp->miniwins[desk] == None)
+		return resized;
+	if (resized && resize) {
+		XMoveResizeWindow(
+			pager->display,
+			cp->miniwins[desk],
+			mp->x,
+			mp->y,
+			mp->width,
+			mp->height
+		);
+	} else {
+		XMoveWindow(
+			pager->display,
+			cp->miniwins[desk],
+			mp->x,
+			mp->y
+		);
+	}
+	return resized;
 }
 
 static void
-configureclient(Pager *pager, int desk, Client *cp)
+markclient(Pager *pager, Client *cp, int dirty)
 {
-	XRectangle *dp;
-
-	dp = &pager->desktops[desk].geometry;
-	cp->minigeoms[desk].x = cp->clientgeom.x * dp->width / pager->rootgeom.width;
-	cp->minigeoms[desk].y = cp->clientgeom.y * dp->height / pager->rootgeom.height;
-	cp->minigeoms[desk].width = cp->clientgeom.width * dp->width / pager->rootgeom.width;
-	if (cp->minigeoms[desk].width < 1)
-		cp->minigeoms[desk].width = 1;
-	cp->minigeoms[desk].height = cp->clientgeom.height * dp->height / pager->rootgeom.height;
-	if (cp->minigeoms[desk].height < 1)
-		cp->minigeoms[desk].height = 1;
-	XMoveResizeWindow(
-		pager->display,
-		cp->miniwins[desk],
-		cp->minigeoms[desk].x,
-		cp->minigeoms[desk].y,
-		cp->minigeoms[desk].width,
-		cp->minigeoms[desk].height
-	);
+	cp->dirty |= dirty;
+	pager->dirty |= DIRTY_CLIENT;
 }
 
 static void
-mapclients(Pager *pager)
+setdue(Pager *pager, unsigned long due)
 {
-	Client *cp;
-	Cardinal i;
-
-	for (i = 0; i < pager->nclients; i++) {
-		cp = pager->clients[i];
-		if (pager->showingdesk) {
-			unmapclient(pager, cp);
-		} else {
-			mapclient(pager, cp);
-		}
-	}
+	/* wake up at the given time to update a deferred client */
+	if (pager->due == 0 || due < pager->due)
+		pager->due = due;
 }
 
 static void
 redrawall(Pager *pager)
 {
-	Cardinal i, j;
+	Cardinal i;
 
 	setdeskgeom(pager);
 	drawdesktops(pager);
 	for (i = 0; i < pager->nclients; i++) {
-		for (j = 0; j < pager->ndesktops; j++)
-			configureclient(pager, j, pager->clients[i]);
-		drawclient(pager, pager->clients[i]);
+		/* the desktops were resized; do not defer the miniatures */
+		pager->clients[i]->lastresize = 0;
+		markclient(pager, pager->clients[i], CLIENT_GEOMETRY | CLIENT_DRAW);
 	}
 }
 
@@ -942,13 +2306,91 @@ createminiwindow(Pager *pager, Window parent, int border)
 	);
 }
 
+static void
+createminiature(Pager *pager, Client *cp, Cardinal desk)
+{
+	Cardinal i;
+
+	cp->miniwins[desk] = createminiwindow(
+		pager,
+		pager->desktops[desk].miniwin,
+		pager->borders[BORDER_WIDTH]
+	);
+	addentry(pager, cp->miniwins[desk], cp, desk);
+	(void)configureclient(pager, desk, cp, true);
+	drawminiature(pager, cp, desk);
+
+	/* stack it just above the nearest client below it on that desktop */
+	for (i = cp->pos; i > 0; i--) {
+		if (pager->clients[i - 1]->miniwins[desk] == None)
+			continue;
+		XConfigureWindow(
+			pager->display,
+			cp->miniwins[desk],
+			CWSibling | CWStackMode,
+			&(XWindowChanges){
+				.sibling = pager->clients[i - 1]->miniwins[desk],
+				.stack_mode = Above,
+			}
+		);
+		return;
+	}
+	XLowerWindow(pager->display, cp->miniwins[desk]);
+}
+
+static void
+mapclient(Pager *pager, Client *cp)
+{
+	Cardinal i;
+
+	/*
+	 * Miniwindows are created on demand, only on the desktops where
+	 * the client is visible, and destroyed when it leaves them; so a
+	 * client usually has a single miniwindow rather than one for each
+	 * desktop.
+	 */
+	if (pager->composite)
+		return;
+	for (i = 0; i < pager->ndesktops; i++) {
+		if (isatdesk(cp, i)) {
+			if (cp->miniwins[i] == None)
+				createminiature(pager, cp, i);
+			XMapWindow(pager->display, cp->miniwins[i]);
+		} else if (cp->miniwins[i] != None) {
+			delentry(pager, cp->miniwins[i]);
+			XDestroyWindow(pager->display, cp->miniwins[i]);
+			cp->miniwins[i] = None;
+			puttile(pager, cp->tiles[i]);
+			cp->tiles[i] = NULL;
+		}
+	}
+}
+
+static void
+mapclients(Pager *pager)
+{
+	Client *cp;
+	Cardinal i;
+
+	if (pager->composite)
+		damagedesktops(pager);
+	for (i = 0; i < pager->nclients; i++) {
+		cp = pager->clients[i];
+		if (pager->showingdesk) {
+			unmapclient(pager, cp);
+		} else {
+			mapclient(pager, cp);
+		}
+	}
+}
+
 static void
 setndesktops(Pager *pager)
 {
 	Cardinal i;
 
-	cleandesktops(pager);
 	cleanclients(pager);
+	cleandesktops(pager);
 	pager->nclients = 0;
 	pager->clients = NULL;
 	pager->ndesktops = getcardprop(
@@ -959,34 +2401,58 @@ setndesktops(Pager *pager)
 	if (pager->ndesktops < 1)
 		return;
 	pager->desktops = ecalloc(pager->ndesktops, sizeof(*pager->desktops));
+	if (pager->composite) {
+		damagedesktops(pager);
+		return;
+	}
 	for (i = 0; i < pager->ndesktops; i++) {
 		pager->desktops[i].miniwin = createminiwindow(pager, pager->window, 0);
+		addentry(pager, pager->desktops[i].miniwin, NULL, i);
 		XMapWindow(pager->display, pager->desktops[i].miniwin);
 	}
 }
 
+static Client *
+getframeclient(Pager *pager, Window window)
+{
+	Entry *entry;
+
+	if ((entry = getentry(pager, window)) == NULL)
+		return NULL;
+	if (entry->client == NULL || entry->client->frame != window)
+		return NULL;
+	return entry->client;
+}
+
 static Client *
 getclient(Pager *pager, Window window)
 {
-	Cardinal i;
+	Entry *entry;
 
-	for (i = 0; i < pager->nclients; i++)
-		if (pager->clients[i]->clientwin == window)
-			return pager->clients[i];
-	return NULL;
+	if ((entry = getentry(pager, window)) == NULL)
+		return NULL;
+	if (entry->client == NULL || entry->client->clientwin != window)
+		return NULL;
+	return entry->client;
+}
+
+static void
+setstates(Pager *pager, Client *cp)
+{
+	cp->states = getstates(pager, cp->clientwin);
 }
 
 static void
-sethidden(Pager *pager, Client *cp)
+sethidden(Client *cp)
 {
-	cp->ishidden = hasstate(pager, cp->clientwin, pager->atoms[_NET_WM_STATE_HIDDEN]);
+	cp->ishidden = FLAG(cp->states, STATE_HIDDEN);
 }
 
 static void
 seturgency(Pager *pager, Client *cp)
 {
 	cp->isurgent = 0;
-	if (hasstate(pager, cp->clientwin, pager->atoms[_NET_WM_STATE_DEMANDS_ATTENTION]))
+	if (FLAG(cp->states, STATE_URGENT))
 		cp->isurgent = true;
 	else if (isurgent(pager, cp->clientwin))
 		cp->isurgent = true;
@@ -995,7 +2461,7 @@ seturgency(Pager *pager, Client *cp)
 static void
 setdesktop(Pager *pager, Client *cp)
 {
-	if (hasstate(pager, cp->clientwin, pager->atoms[_NET_WM_STATE_STICKY])) {
+	if (FLAG(cp->states, STATE_STICKY)) {
 		cp->desk = ALLDESKTOPS;
 		return;
 	}
@@ -1003,84 +2469,611 @@ setdesktop(Pager *pager, Client *cp)
 }
 
 static void
-raiseclients(Pager *pager)
+restackclients(Pager *pager, Cardinal *prev)
 {
-	Cardinal i, j;
+	Cardinal *tails, *links;
+	Cardinal i, j, lo, hi, mid, len;
+	Window win, below;
+	bool *moved;
 
+	/*
+	 * The clients in the longest subsequence of the stacking list
+	 * whose previous positions are increasing keep their relative
+	 * order, and are not touched.  Each other client (including new
+	 * ones) is restacked on each desktop just above the client below
+	 * it, from bottom to top; so only the miniwindows that actually
+	 * moved cost a request.  Without previous positions, every client
+	 * is restacked.
+	 */
+	if (pager->composite)
+		damagedesktops(pager);
+	if (pager->composite || pager->nclients == 0)
+		return;
+	tails = ecalloc(pager->nclients, sizeof(*tails));
+	links = ecalloc(pager->nclients, sizeof(*links));
+	moved = ecalloc(pager->nclients, sizeof(*moved));
+	len = 0;
 	for (i = 0; i < pager->nclients; i++) {
-		for (j = 0; j < pager->ndesktops; j++) {
-			XRaiseWindow(
-				pager->display,
-				pager->clients[i]->miniwins[j]
+		moved[i] = true;
+		if (prev == NULL || prev[i] == NOPOS)
+			continue;
+		lo = 0;
+		hi = len;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (prev[tails[mid]] < prev[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		links[i] = lo > 0 ? tails[lo - 1] : NOPOS;
+		tails[lo] = i;
+		if (lo == len)
+			len++;
+	}
+	for (i = len > 0 ? tails[len - 1] : NOPOS; i != NOPOS; i = links[i])
+		moved[i] = false;
+	for (j = 0; j < pager->ndesktops; j++) {
+		below = None;
+		for (i = 0; i < pager->nclients; i++) {
+			if ((win = pager->clients[i]->miniwins[j]) == None)
+				continue;
+			if (moved[i] && below == None) {
+				XLowerWindow(pager->display, win);
+			} else if (moved[i]) {
+				XConfigureWindow(
+					pager->display,
+					win,
+					CWSibling | CWStackMode,
+					&(XWindowChanges){
+						.sibling = below,
+						.stack_mode = Above,
+					}
+				);
+			}
+			below = win;
+		}
+	}
+	free(tails);
+	free(links);
+	free(moved);
+}
+
+static IconFetch *
+cachedicon(Pager *pager, Window win, const char *class, unsigned long length)
+{
+	IconFetch *fetch;
+	DiskIcon *rec;
+	Icon *icon;
+
+	/*
+	 * Get the icon of a new window from the icon of another window of
+	 * the same class, if its _NET_WM_ICON has the same size; so the
+	 * windows of an application share their icon without fetching its
+	 * pixels.  This is for new windows only: a changed icon (a badge,
+	 * say) may keep its size, so a reload always fetches the pixels.
+	 *
+	 * Failing that, get it from the disk cache.  The cache is shared
+	 * with other instances of the pager, so a record can be torn by a
+	 * concurrent write; but then its pixels do not match its hash.
+	 */
+	if (class == NULL || length == 0)
+		return NULL;
+	for (icon = pager->icons; icon != NULL; icon = icon->next)
+		if (icon->class != NULL && icon->length == length &&
+		    strcmp(icon->class, class) == 0)
+			break;
+	fetch = ecalloc(1, sizeof(*fetch));
+	fetch->window = win;
+	fetch->length = length;
+	fetch->hasicon = true;
+	if (icon != NULL) {
+		fetch->stale = !icon->live;
+		fetch->hash = icon->hash;
+		memcpy(fetch->pixels, icon->pixels, sizeof(fetch->pixels));
+		return fetch;
+	}
+	rec = getdiskicon(pager->diskcache, class);
+	if (rec != NULL && rec->length == length &&
+	    strncmp(rec->class, class, CLASSLEN) == 0) {
+		memcpy(fetch->pixels, rec->pixels, sizeof(fetch->pixels));
+		fetch->hash = rec->hash;
+		if (hashicon(fetch->pixels) == fetch->hash) {
+			fetch->stale = true;
+			if ((fetch->class = strdup(class)) == NULL)
+				err(1, "strdup");
+			return fetch;
+		}
+	}
+	free(fetch);
+	return NULL;
+}
+
+static Client *
+applyicon(Pager *pager, IconFetch *fetch)
+{
+	Client *cp;
+	Icon *icon;
+	Cardinal i;
+
+	/*
+	 * Install a fetched icon, and return the client whose icon has
+	 * changed, if any.  The client may be gone by now.
+	 *
+	 * An icon from a cache is trusted if it is the same icon fetched
+	 * live for another client of the same class (ten terminals, say);
+	 * otherwise, it is checked against the property once the interval
+	 * is over.
+	 */
+	if ((cp = getclient(pager, fetch->window)) == NULL)
+		goto done;
+	if (!fetch->hasicon) {
+		icon = NULL;
+	} else if (cp->icon != NULL && cp->icon->hash == fetch->hash &&
+	           memcmp(cp->icon->pixels, fetch->pixels, sizeof(fetch->pixels)) == 0) {
+		icon = cp->icon;
+	} else {
+		icon = findicon(pager, fetch->pixels, fetch->hash, fetch->class, fetch->length);
+		fetch->class = NULL;    /* findicon() takes it */
+	}
+	if (icon != NULL && !fetch->stale)
+		icon->live = true;
+	if (fetch->stale && (icon == NULL || !icon->live)) {
+		cp->iconreload = now();
+		markclient(pager, cp, CLIENT_ICON);
+	}
+	if (icon == cp->icon) {
+		cp = NULL;
+		goto done;
+	}
+	for (i = 0; i < pager->ndesktops; i++) {
+		puttile(pager, cp->tiles[i]);
+		cp->tiles[i] = NULL;
+	}
+	puticon(pager, cp->icon);
+	cp->icon = icon;
+done:
+	free(fetch->class);
+	free(fetch);
+	return cp;
+}
+
+static void
+readicons(Pager *pager)
+{
+	IconFetch *fetch;
+	Client *cp;
+
+	while (read(pager->resfd[0], &fetch, sizeof(fetch)) == sizeof(fetch)) {
+		pager->nfetches--;
+		if ((cp = applyicon(pager, fetch)) != NULL)
+			markclient(pager, cp, CLIENT_DRAW);
+	}
+}
+
+static bool
+requesticon(Pager *pager, Client *cp)
+{
+	/*
+	 * Queue the window for the worker; the client keeps its current
+	 * (or the default) icon until the fetched one arrives.  Without a
+	 * worker, or with too many pending requests, fetch it right away,
+	 * and return whether the icon has changed.
+	 */
+	if (pager->workerdpy != NULL && write(pager->reqfd[1], &cp->clientwin, sizeof(cp->clientwin)) == sizeof(cp->clientwin)) {
+		pager->nfetches++;
+		return false;
+	}
+	return applyicon(pager, fetchicon(pager, pager->display, cp->clientwin)) != NULL;
+}
+
+static void *
+worker(void *arg)
+{
+	Pager *pager;
+	IconFetch *fetch;
+	Window win;
+
+	pager = arg;
+	while (read(pager->reqfd[0], &win, sizeof(win)) == sizeof(win)) {
+		fetch = fetchicon(pager, pager->workerdpy, win);
+		if (write(pager->resfd[1], &fetch, sizeof(fetch)) != sizeof(fetch)) {
+			free(fetch->class);
+			free(fetch);
+		}
+	}
+	(void)close(pager->resfd[1]);
+	return NULL;
+}
+
+static void
+startworker(Pager *pager)
+{
+	Display *display;
+	int reqfd[2] = { -1, -1 };
+	int resfd[2] = { -1, -1 };
+
+	/*
+	 * Icons are fetched and decoded by a worker thread with its own
+	 * connection to the server, so a batch of new windows does not
+	 * block the event loop.  Requests (windows) and results (pointers
+	 * to fetched icons) go through pipes, whose writes are atomic.
+	 */
+	if ((display = XOpenDisplay(DisplayString(pager->display))) == NULL)
+		goto error;
+	if (pipe(reqfd) == -1 || pipe(resfd) == -1)
+		goto error;
+	if (fcntl(reqfd[1], F_SETFL, O_NONBLOCK) == -1)
+		goto error;
+	if (fcntl(resfd[0], F_SETFL, O_NONBLOCK) == -1)
+		goto error;
+	pager->workerdpy = display;
+	memcpy(pager->reqfd, reqfd, sizeof(reqfd));
+	memcpy(pager->resfd, resfd, sizeof(resfd));
+	if (pthread_create(&pager->worker, NULL, worker, pager) == 0)
+		return;
+	pager->workerdpy = NULL;
+error:
+	warnx("could not start icon worker; fetching icons synchronously");
+	if (display != NULL)
+		XCloseDisplay(display);
+	if (reqfd[0] != -1)
+		(void)close(reqfd[0]);
+	if (reqfd[1] != -1)
+		(void)close(reqfd[1]);
+	if (resfd[0] != -1)
+		(void)close(resfd[0]);
+	if (resfd[1] != -1)
+		(void)close(resfd[1]);
+}
+
+static void
+stopworker(Pager *pager)
+{
+	IconFetch *fetch;
+
+	/*
+	 * Closing the request pipe makes the worker quit; drain its results
+	 * until it closes the result pipe, so it never blocks on it.
+	 */
+	if (pager->workerdpy == NULL)
+		return;
+	(void)close(pager->reqfd[1]);
+	(void)fcntl(pager->resfd[0], F_SETFL, 0);
+	while (read(pager->resfd[0], &fetch, sizeof(fetch)) == sizeof(fetch)) {
+		free(fetch->class);
+		free(fetch);
+	}
+	(void)pthread_join(pager->worker, NULL);
+	(void)close(pager->reqfd[0]);
+	(void)close(pager->resfd[0]);
+	XCloseDisplay(pager->workerdpy);
+	pager->workerdpy = NULL;
+}
+
+static Client *
+newclient(Pager *pager, Window win)
+{
+	Client *cp;
+
+	/* the properties and geometry are fetched by initclients() */
+	cp = emalloc(sizeof(*cp));
+	*cp = (Client) { 0 };
+	cp->clientwin = win;
+	cp->drawnscheme = -1;
+	cp->drawnhidden = true;
+	addentry(pager, win, cp, 0);
+	preparewin(pager, win);
+	cp->minigeoms = ecalloc(pager->ndesktops, sizeof(*cp->minigeoms));
+	cp->miniwins = ecalloc(pager->ndesktops, sizeof(*cp->miniwins));
+	cp->tiles = ecalloc(pager->ndesktops, sizeof(*cp->tiles));
+	return cp;
+}
+
+static void
+snapframes(Pager *pager, Client **cps, Cardinal n)
+{
+	xcb_connection_t *conn;
+	xcb_query_tree_reply_t *tree;
+	xcb_get_geometry_reply_t *geom;
+	xcb_translate_coordinates_reply_t *origin;
+	struct {
+		Window frame;
+		bool done;
+		xcb_query_tree_cookie_t tree;
+		xcb_get_geometry_cookie_t geom;
+		xcb_translate_coordinates_cookie_t origin, offset;
+	} *snaps;
+	Cardinal i, depth;
+	bool pending, framed;
+
+	/*
+	 * Take a snapshot of the geometry of a batch of clients: find the
+	 * frame of each client, walking up the tree one level at a time
+	 * for the whole batch; then get the origin of each client, and its
+	 * offset in the frame.  Each step costs a single round trip.
+	 */
+	if (n == 0)
+		return;
+	conn = XGetXCBConnection(pager->display);
+	snaps = ecalloc(n, sizeof(*snaps));
+	for (i = 0; i < n; i++)
+		snaps[i].frame = cps[i]->clientwin;
+	for (depth = 0, pending = true; pending && depth < MAXDEPTH; depth++) {
+		for (i = 0; i < n; i++)
+			if (!snaps[i].done)
+				snaps[i].tree = xcb_query_tree(conn, snaps[i].frame);
+		pending = false;
+		for (i = 0; i < n; i++) {
+			if (snaps[i].done)
+				continue;
+			tree = xcb_query_tree_reply(conn, snaps[i].tree, NULL);
+			if (tree == NULL || tree->parent == None) {
+				snaps[i].frame = None;
+				snaps[i].done = true;
+			} else if (tree->parent == pager->root) {
+				snaps[i].done = true;
+			} else {
+				snaps[i].frame = tree->parent;
+				pending = true;
+			}
+			free(tree);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		snaps[i].geom = xcb_get_geometry(conn, cps[i]->clientwin);
+		snaps[i].origin = xcb_translate_coordinates(
+			conn,
+			cps[i]->clientwin,
+			pager->root,
+			0, 0
+		);
+		framed = snaps[i].done && snaps[i].frame != None &&
+		         snaps[i].frame != cps[i]->clientwin;
+		if (framed) {
+			snaps[i].offset = xcb_translate_coordinates(
+				conn,
+				cps[i]->clientwin,
+				snaps[i].frame,
+				0, 0
 			);
 		}
 	}
+	for (i = 0; i < n; i++) {
+		if ((geom = xcb_get_geometry_reply(conn, snaps[i].geom, NULL)) != NULL) {
+			cps[i]->clientgeom.width = geom->width;
+			cps[i]->clientgeom.height = geom->height;
+			cps[i]->relx = geom->x + geom->border_width;
+			cps[i]->rely = geom->y + geom->border_width;
+			free(geom);
+		}
+		if ((origin = xcb_translate_coordinates_reply(conn, snaps[i].origin, NULL)) != NULL) {
+			cps[i]->clientgeom.x = origin->dst_x;
+			cps[i]->clientgeom.y = origin->dst_y;
+			free(origin);
+		}
+		framed = snaps[i].done && snaps[i].frame != None &&
+		         snaps[i].frame != cps[i]->clientwin;
+		cps[i]->offx = cps[i]->offy = 0;
+		if (framed) {
+			origin = xcb_translate_coordinates_reply(conn, snaps[i].offset, NULL);
+			if (origin != NULL) {
+				cps[i]->offx = origin->dst_x;
+				cps[i]->offy = origin->dst_y;
+				free(origin);
+			}
+		}
+		setframe(pager, cps[i], framed ? snaps[i].frame : None);
+		if (cps[i]->frame == None) {
+			/* not reparented; the position is relative to the root */
+			cps[i]->offx = cps[i]->relx;
+			cps[i]->offy = cps[i]->rely;
+		}
+		cps[i]->framex = cps[i]->clientgeom.x - cps[i]->offx;
+		cps[i]->framey = cps[i]->clientgeom.y - cps[i]->offy;
+	}
+	free(snaps);
+}
+
+static void
+initclients(Pager *pager, Client **cps, Cardinal n)
+{
+	xcb_connection_t *conn;
+	xcb_get_property_reply_t *prop;
+	IconFetch *fetch;
+	uint32_t *values;
+	struct {
+		xcb_get_property_cookie_t states, desktop, hints, class, icon;
+	} *cookies;
+	Client *cp;
+	Cardinal i, j, len;
+	unsigned long length;
+	char *class, *p;
+
+	/*
+	 * Send the requests for the states, desktop, hints, class and icon
+	 * size of a batch of new clients all at once, and only then
+	 * collect their replies; so the batch costs a few round trips (see
+	 * snapframes()), rather than several per client.  Errors (for
+	 * windows already gone) come with the replies, and are dropped.
+	 */
+	if (n == 0)
+		return;
+	conn = XGetXCBConnection(pager->display);
+	cookies = ecalloc(n, sizeof(*cookies));
+	for (i = 0; i < n; i++) {
+		cookies[i].states = xcb_get_property(
+			conn, 0,
+			cps[i]->clientwin,
+			pager->atoms[_NET_WM_STATE],
+			XCB_ATOM_ATOM,
+			0, 1024
+		);
+		cookies[i].desktop = xcb_get_property(
+			conn, 0,
+			cps[i]->clientwin,
+			pager->atoms[_NET_WM_DESKTOP],
+			XCB_ATOM_CARDINAL,
+			0, 1
+		);
+		cookies[i].hints = xcb_get_property(
+			conn, 0,
+			cps[i]->clientwin,
+			XCB_ATOM_WM_HINTS,
+			XCB_ATOM_WM_HINTS,
+			0, 1
+		);
+		cookies[i].class = xcb_get_property(
+			conn, 0,
+			cps[i]->clientwin,
+			XCB_ATOM_WM_CLASS,
+			XCB_ATOM_STRING,
+			0, 1024
+		);
+		cookies[i].icon = xcb_get_property(
+			conn, 0,
+			cps[i]->clientwin,
+			pager->atoms[_NET_WM_ICON],
+			XCB_ATOM_CARDINAL,
+			0, 0
+		);
+	}
+	snapframes(pager, cps, n);
+	for (i = 0; i < n; i++) {
+		cp = cps[i];
+		if ((prop = xcb_get_property_reply(conn, cookies[i].states, NULL)) != NULL) {
+			values = xcb_get_property_value(prop);
+			len = xcb_get_property_value_length(prop) / sizeof(*values);
+			for (j = 0; prop->format == 32 && j < len; j++)
+				cp->states |= getstate(pager, values[j]);
+			free(prop);
+		}
+		sethidden(cp);
+		if ((prop = xcb_get_property_reply(conn, cookies[i].desktop, NULL)) != NULL) {
+			values = xcb_get_property_value(prop);
+			if (prop->format == 32 && xcb_get_property_value_length(prop) >= 4)
+				cp->desk = values[0];
+			free(prop);
+		}
+		if (FLAG(cp->states, STATE_STICKY))
+			cp->desk = ALLDESKTOPS;
+		cp->isurgent = FLAG(cp->states, STATE_URGENT);
+		if ((prop = xcb_get_property_reply(conn, cookies[i].hints, NULL)) != NULL) {
+			values = xcb_get_property_value(prop);
+			if (prop->format == 32 && xcb_get_property_value_length(prop) >= 4 &&
+			    FLAG(values[0], XUrgencyHint))
+				cp->isurgent = true;
+			free(prop);
+		}
+		for (j = 0; j < pager->ndesktops; j++)
+			(void)configureclient(pager, j, cp, true);
+		markclient(pager, cp, CLIENT_MAP);
+
+		/* WM_CLASS is the instance and the class, each null-terminated */
+		class = NULL;
+		if ((prop = xcb_get_property_reply(conn, cookies[i].class, NULL)) != NULL) {
+			p = xcb_get_property_value(prop);
+			len = xcb_get_property_value_length(prop);
+			for (j = 0; j < len && p[j] != '\0'; j++)
+				;
+			if (prop->format == 8 && ++j < len && (class = strndup(p + j, len - j)) == NULL)
+				err(1, "strndup");
+			free(prop);
+		}
+		length = 0;
+		if ((prop = xcb_get_property_reply(conn, cookies[i].icon, NULL)) != NULL) {
+			length = prop->bytes_after;
+			free(prop);
+		}
+		if ((fetch = cachedicon(pager, cp->clientwin, class, length)) != NULL)
+			(void)applyicon(pager, fetch);
+		else if (length > 0)
+			(void)requesticon(pager, cp);
+		free(class);
+	}
+	free(cookies);
 }
 
 static void
 setclients(Pager *pager)
 {
 	Client **clients = NULL;
+	Client *cp;
 	Window *wins = NULL;
+	Cardinal *prev = NULL;
+	Cardinal nwins = 0;
+	Client *newclients[NEWCLIENTS];
 	Cardinal nclients = 0;
-	Cardinal i, j;
+	Cardinal nnew = 0;
+	Cardinal i, last;
+	bool changed;
 
 	if (pager->ndesktops > 0) {
-		nclients = getwinprop(
+		nwins = getwinprop(
 			pager,
 			pager->root,
 			pager->atoms[_NET_CLIENT_LIST_STACKING],
 			&wins
 		);
 	}
-	if (nclients > 0)
-		clients = ecalloc(nclients, sizeof(*clients));
-	for (i = 0; i < nclients; i++) {
-		clients[i] = NULL;
-		for (j = 0; j < pager->nclients; j++) {
-			if (pager->clients[j] == NULL)
-				continue;
-			if (pager->clients[j]->clientwin != wins[i])
+	if (nwins > 0) {
+		clients = ecalloc(nwins, sizeof(*clients));
+		prev = ecalloc(nwins, sizeof(*prev));
+	}
+
+	/*
+	 * Diff the new list against the old one in linear time.  Windows
+	 * of known clients are looked up in the index; the client is kept
+	 * and taken out of the old list.  Windows not found are new, and
+	 * get a new client.  Clients left in the old list are removed.
+	 *
+	 * If the kept clients are still in the same order, there is
+	 * nothing to restack: new clients have no miniwindows yet, and
+	 * those are stacked when created (see createminiature()).
+	 * Otherwise, the previous positions are used to restack only what
+	 * has moved.
+	 */
+	changed = false;
+	last = 0;
+	pager->populating = false;
+	for (i = 0; i < nwins; i++) {
+		if ((cp = getclient(pager, wins[i])) == NULL) {
+			if (nnew == NEWCLIENTS) {
+				/* add the other new windows on the next iterations */
+				pager->populating = true;
 				continue;
-			clients[i] = pager->clients[j];
-			pager->clients[j] = NULL;
-			break;
-		}
-		if (clients[i] != NULL)
-			continue;
-		clients[i] = emalloc(sizeof(*clients[i]));
-		*clients[i] = (Client) { 0 };
-		clients[i]->clientwin = wins[i];
-		preparewin(pager, wins[i]);
-		clients[i]->icon = geticonprop(pager, wins[i]);
-		sethidden(pager, clients[i]);
-		setdesktop(pager, clients[i]);
-		seturgency(pager, clients[i]);
-		setclientgeometry(pager, clients[i]);
-		clients[i]->minigeoms = ecalloc(
-			pager->ndesktops,
-			sizeof(*clients[i]->minigeoms)
-		);
-		clients[i]->miniwins = ecalloc(
-			pager->ndesktops,
-			sizeof(*clients[i]->miniwins)
-		);
-		for (j = 0; j < pager->ndesktops; j++) {
-			clients[i]->miniwins[j] = createminiwindow(
-				pager,
-				pager->desktops[j].miniwin,
-				pager->borders[BORDER_WIDTH]
-			);
-			configureclient(pager, j, clients[i]);
+			}
+			cp = newclient(pager, wins[i]);
+			newclients[nnew++] = cp;
+			prev[nclients] = NOPOS;
+		} else if (cp->pos < pager->nclients && pager->clients[cp->pos] == cp) {
+			pager->clients[cp->pos] = NULL;
+			prev[nclients] = cp->pos;
+			if (cp->pos < last)
+				changed = true;
+			last = cp->pos;
+		} else {
+			continue;       /* window listed twice */
 		}
-		drawclient(pager, clients[i]);
+		cp->pos = nclients;
+		clients[nclients++] = cp;
 	}
+	initclients(pager, newclients, nnew);
 	cleanclients(pager);
 	pager->clients = clients;
 	pager->nclients = nclients;
 	XFree(wins);
-	raiseclients(pager);
-	mapclients(pager);
+	if (changed && pager->populating) {
+		/*
+		 * Restack once, after the last batch; the previous positions
+		 * of the batches in between are lost, so restack every client.
+		 */
+		pager->unstacked = true;
+	} else if (changed || pager->unstacked) {
+		restackclients(pager, pager->unstacked ? NULL : prev);
+		pager->unstacked = false;
+	}
+	free(prev);
 }
 
 static void
@@ -1111,7 +3104,9 @@ setcurrdesktop(Pager *pager)
 		pager->atoms[_NET_CURRENT_DESKTOP]
 	);
 	if (prevdesktop != pager->activedesktop) {
-		drawdesktops(pager);
+		/* only the highlight of those two desktops changed */
+		drawdesktop(pager, prevdesktop);
+		drawdesktop(pager, pager->activedesktop);
 	}
 }
 
@@ -1129,9 +3124,9 @@ setactive(Pager *pager)
 	}
 	if (prevactive != pager->activeclient) {
 		if (prevactive != NULL)
-			drawclient(pager, prevactive);
+			markclient(pager, prevactive, CLIENT_ACTIVE);
 		if (pager->activeclient != NULL)
-			drawclient(pager, pager->activeclient);
+			markclient(pager, pager->activeclient, CLIENT_ACTIVE);
 	}
 }
 
@@ -1142,14 +3137,56 @@ between(int pos, int from, int len)
 }
 
 static void
-mousemove(Pager *pager, Client *cp, Window win, int dx, int dy, Time time)
+damagedrag(Pager *pager)
+{
+	XRectangle *desk;
+	Cardinal i;
+	int off, w, h;
+
+	/* damage the desktops under the miniature being dragged */
+	off = pager->borders[FRAME_WIDTH];
+	w = pager->drag->minigeoms[pager->dragdesk].width + 2 * pager->borders[BORDER_WIDTH];
+	h = pager->drag->minigeoms[pager->dragdesk].height + 2 * pager->borders[BORDER_WIDTH];
+	for (i = 0; i < pager->ndesktops; i++) {
+		desk = &pager->desktops[i].geometry;
+		if (pager->dragx >= off + desk->x + desk->width || pager->dragx + w <= off + desk->x)
+			continue;
+		if (pager->dragy >= off + desk->y + desk->height || pager->dragy + h <= off + desk->y)
+			continue;
+		pager->desktops[i].damaged = true;
+		pager->damaged = true;
+	}
+}
+
+static void
+dragto(Pager *pager, Window win, int x, int y)
+{
+	if (pager->composite) {
+		/* redraw only the desktops under the old and new positions */
+		damagedrag(pager);
+		pager->dragx = x;
+		pager->dragy = y;
+		damagedrag(pager);
+		drawframe(pager);
+	} else {
+		XMoveWindow(pager->display, win, x, y);
+	}
+}
+
+static void
+mousemove(Pager *pager, Client *cp, XButtonEvent *press)
 {
 	XEvent ev;
 	XRectangle *desk;
+	struct pollfd pfd;
 	Cardinal i, newdesk, olddesk;
-	int status, newx, newy;
+	unsigned long interval, elapsed, lastmove;
+	int status, newx, newy, offx, offy, dx, dy, timeout;
+	bool pending;
+	Time time;
 	Window dw;
 
+	time = press->time;
 	if (cp->desk == ALLDESKTOPS) {
 		clientmsg(
 			pager,
@@ -1159,21 +3196,51 @@ mousemove(Pager *pager, Client *cp, Window win, int dx, int dy, Time time)
 		);
 		return;
 	}
-	XTranslateCoordinates(
-		pager->display,
-		win,
-		pager->window,
-		0 - pager->borders[BORDER_WIDTH],
-		0 - pager->borders[BORDER_WIDTH],
-		&newx, &newy,
-		&dw
-	);
 	olddesk = newdesk = cp->desk;
-	XReparentWindow(pager->display, win, pager->window, newx, newy);
-	XSync(pager->display, False);
+	if (pager->composite) {
+		/* the pointer was pressed on the pager window itself */
+		newx = pager->borders[FRAME_WIDTH];
+		newx += pager->desktops[olddesk].geometry.x;
+		newx += cp->minigeoms[olddesk].x;
+		newy = pager->borders[FRAME_WIDTH];
+		newy += pager->desktops[olddesk].geometry.y;
+		newy += cp->minigeoms[olddesk].y;
+		dx = press->x - newx - pager->borders[BORDER_WIDTH];
+		dy = press->y - newy - pager->borders[BORDER_WIDTH];
+	} else {
+		XTranslateCoordinates(
+			pager->display,
+			press->window,
+			pager->window,
+			0 - pager->borders[BORDER_WIDTH],
+			0 - pager->borders[BORDER_WIDTH],
+			&newx, &newy,
+			&dw
+		);
+		dx = press->x;
+		dy = press->y;
+	}
+
+	/*
+	 * Positions are computed from the root coordinates of the pointer,
+	 * which (unlike the coordinates relative to the grabbed window) do
+	 * not depend on whether the server has already processed our last
+	 * move request.  This lets us skip motion events still queued and
+	 * move the miniwindow to the latest position only.
+	 */
+	offx = press->x_root - newx;
+	offy = press->y_root - newy;
+	if (pager->composite) {
+		pager->drag = cp;
+		pager->dragdesk = olddesk;
+		pager->dragx = newx;
+		pager->dragy = newy;
+	} else {
+		XReparentWindow(pager->display, press->window, pager->window, newx, newy);
+	}
 	status = XGrabPointer(
 		pager->display,
-		win,
+		press->window,
 		False,
 		MOUSEEVENTMASK,
 		GrabModeAsync, GrabModeAsync,
@@ -1182,36 +3249,70 @@ mousemove(Pager *pager, Client *cp, Window win, int dx, int dy, Time time)
 	);
 	if (status != GrabSuccess)
 		goto done;
-	while (!XMaskEvent(pager->display, MOUSEEVENTMASK, &ev)) switch (ev.type) {
-	case ButtonRelease:
-		newx += ev.xbutton.x;
-		newy += ev.xbutton.y;
-		for (i = 0; i < pager->ndesktops; i++) {
-			desk = &pager->desktops[i].geometry;
-			if (!between(newx, desk->x, desk->width))
+	interval = 0;
+	if (pager->settings[MOTION_RATE] > 0)
+		interval = 1000 / pager->settings[MOTION_RATE];
+	pfd.fd = ConnectionNumber(pager->display);
+	pfd.events = POLLIN;
+	pending = false;
+	lastmove = 0;
+	for (;;) {
+		if (XCheckMaskEvent(pager->display, MOUSEEVENTMASK, &ev)) {
+			if (ev.type == MotionNotify) {
+				newx = ev.xmotion.x_root - offx;
+				newy = ev.xmotion.y_root - offy;
+				pending = true;
 				continue;
-			if (!between(newy, desk->y, desk->height))
+			}
+			if (ev.type != ButtonRelease)
 				continue;
-			newdesk = i;
-			break;
+			newx = ev.xbutton.x_root - offx + dx;
+			newy = ev.xbutton.y_root - offy + dy;
+			for (i = 0; i < pager->ndesktops; i++) {
+				desk = &pager->desktops[i].geometry;
+				if (!between(newx, desk->x, desk->width))
+					continue;
+				if (!between(newy, desk->y, desk->height))
+					continue;
+				newdesk = i;
+				break;
+			}
+			XUngrabPointer(pager->display, ev.xbutton.time);
+			time = ev.xbutton.time;
+			goto done;
 		}
-		XUngrabPointer(pager->display, ev.xbutton.time);
-		time = ev.xbutton.time;
-		goto done;
-	case MotionNotify:
-		newx += ev.xmotion.x - dx;
-		newy += ev.xmotion.y - dy;
-		XMoveWindow(pager->display, win, newx, newy);
-		break;
+
+		/* no more mouse events queued; move to the latest position */
+		timeout = -1;
+		if (pending) {
+			elapsed = now() - lastmove;
+			if (elapsed >= interval) {
+				dragto(pager, press->window, newx, newy);
+				lastmove = now();
+				pending = false;
+				continue;
+			}
+			timeout = interval - elapsed;
+		}
+		XFlush(pager->display);
+		(void)poll(&pfd, 1, timeout);
 	}
 done:
-	XReparentWindow(
-		pager->display,
-		win,
-		pager->desktops[olddesk].miniwin,
-		cp->minigeoms[olddesk].x,
-		cp->minigeoms[olddesk].y
-	);
+	if (pager->composite) {
+		damagedrag(pager);
+		pager->drag = NULL;
+		pager->desktops[olddesk].damaged = true;
+		pager->damaged = true;
+		drawframe(pager);
+	} else {
+		XReparentWindow(
+			pager->display,
+			press->window,
+			pager->desktops[olddesk].miniwin,
+			cp->minigeoms[olddesk].x,
+			cp->minigeoms[olddesk].y
+		);
+	}
 	if (newdesk != olddesk) {
 		clientmsg(
 			pager,
@@ -1293,6 +3394,19 @@ setgeometry(const char *value, XRectangle *root, XRectangle *rect)
 	return retval;
 }
 
+static void
+setrendermode(Pager *pager, const char *value)
+{
+	if (pager->running)
+		return;         /* the rendering mode is only read at startup */
+	if (strcasecmp(value, "composite") == 0)
+		pager->composite = true;
+	else if (strcasecmp(value, "windows") == 0)
+		pager->composite = false;
+	else
+		warnx("%s: unknown rendering mode", value);
+}
+
 static XrmDatabase
 newxdb(Pager *pager, const char *str)
 {
@@ -1353,12 +3467,16 @@ loadresources(Pager *pager, const char *str)
 			setcolor(pager, value, &pager->colors[res].channels);
 		} else if (res < NCOLORS + NBORDERS) {
 			setnumber(value, &pager->borders[res - NCOLORS]);
+		} else if (res < NCOLORS + NBORDERS + NSETTINGS) {
+			setnumber(value, &pager->settings[res - NCOLORS - NBORDERS]);
 		} else if (res == RES_GEOMETRY) {
 			pager->geomflags = setgeometry(
 				value,
 				&pager->rootgeom,
 				&pager->geometry
 			);
+		} else if (res == RES_RENDER_MODE) {
+			setrendermode(pager, value);
 		}
 	}
 	XrmDestroyDatabase(xdb);
@@ -1380,45 +3498,292 @@ fillcolors(Pager *pager)
 			0, 0, 1, 1
 		);
 	}
+	fillframes(pager);
+}
+
+static void
+updateclient(Pager *pager, Client *cp)
+{
+	Cardinal i;
+	unsigned long due;
+	int dirty;
+	bool resize, resized;
+
+	dirty = cp->dirty;
+	cp->dirty = 0;
+	if (dirty & CLIENT_ICON) {
+		/*
+		 * Reload the icon at most once per interval; a client whose
+		 * icon changes too soon is left dirty until it is due.
+		 */
+		dirty &= ~CLIENT_ICON;
+		due = cp->iconreload + pager->settings[ICON_INTERVAL];
+		if (cp->iconreload != 0 && now() < due) {
+			cp->dirty |= CLIENT_ICON;
+			setdue(pager, due);
+		} else {
+			cp->iconreload = now();
+			if (requesticon(pager, cp)) {
+				dirty |= CLIENT_DRAW;
+			}
+		}
+	}
+	if (dirty == 0)
+		return;
+	if (dirty & CLIENT_STATE) {
+		setstates(pager, cp);
+		sethidden(cp);
+	}
+	if (dirty & (CLIENT_STATE | CLIENT_DESKTOP))
+		setdesktop(pager, cp);
+	if (dirty & (CLIENT_STATE | CLIENT_HINTS))
+		seturgency(pager, cp);
+
+	/*
+	 * Most property changes (such as a window being maximized or
+	 * rewriting its WM_HINTS) leave the miniatures as they are; only
+	 * redraw or remap them if their scheme, desktop or visibility
+	 * actually changed.
+	 */
+	if ((dirty & (CLIENT_STATE | CLIENT_HINTS | CLIENT_ACTIVE)) &&
+	    getscheme(pager, cp) != cp->drawnscheme)
+		dirty |= CLIENT_DRAW;
+	if ((dirty & (CLIENT_STATE | CLIENT_DESKTOP)) &&
+	    (cp->desk != cp->drawndesk || cp->ishidden != cp->drawnhidden))
+		dirty |= CLIENT_MAP;
+	if (!(dirty & (CLIENT_GEOMETRY | CLIENT_DRAW | CLIENT_MAP))) {
+		pager->nskipped++;
+		return;
+	}
+	damageclient(pager, cp);
+	if (dirty & CLIENT_GEOMETRY) {
+		/*
+		 * Moving a miniature is cheap, but resizing it needs it to
+		 * be redrawn; so resize it at most RESIZE_RATE times per
+		 * second, and leave the client dirty until it is due.
+		 */
+		due = cp->lastresize;
+		if (pager->settings[RESIZE_RATE] > 0)
+			due += 1000 / pager->settings[RESIZE_RATE];
+		resize = (cp->lastresize == 0 || now() >= due);
+		resized = false;
+		for (i = 0; i < pager->ndesktops; i++)
+			if (configureclient(pager, i, cp, resize))
+				resized = true;
+		if (resized && resize) {
+			cp->lastresize = now();
+			dirty |= CLIENT_DRAW;
+		} else if (resized) {
+			cp->dirty |= CLIENT_GEOMETRY;
+			setdue(pager, due);
+		}
+	}
+	if (dirty & CLIENT_DRAW) {
+		cp->drawnscheme = getscheme(pager, cp);
+		drawclient(pager, cp);
+	}
+	if (dirty & CLIENT_MAP) {
+		cp->drawndesk = cp->desk;
+		cp->drawnhidden = cp->ishidden;
+		if (pager->showingdesk)
+			unmapclient(pager, cp);
+		else
+			mapclient(pager, cp);
+	}
+	damageclient(pager, cp);
+}
+
+static void
+reframeclients(Pager *pager)
+{
+	Client **cps;
+	Cardinal i, n;
+
+	/* take a new snapshot of the geometry of reparented clients */
+	cps = NULL;
+	for (i = n = 0; i < pager->nclients; i++) {
+		if (!(pager->clients[i]->dirty & CLIENT_FRAME))
+			continue;
+		if (cps == NULL)
+			cps = ecalloc(pager->nclients, sizeof(*cps));
+		pager->clients[i]->dirty &= ~CLIENT_FRAME;
+		cps[n++] = pager->clients[i];
+	}
+	snapframes(pager, cps, n);
+	free(cps);
+}
+
+static void
+reportstats(Pager *pager)
+{
+	/*
+	 * The first frame (the desktops alone) is out at the end of
+	 * setup(); the pager is complete once every client has been added
+	 * and every queued icon has come back from the worker.  Sync, so
+	 * the times include the work of the server.
+	 */
+	if (pager->donetime != 0 || pager->populating || pager->nfetches > 0)
+		return;
+	XSync(pager->display, False);
+	pager->donetime = now();
+	(void)fprintf(
+		stderr,
+		"%s: first paint: %lums; complete: %lums; %lu clients\n",
+		APP_NAME,
+		pager->painttime - pager->starttime,
+		pager->donetime - pager->starttime,
+		pager->nclients
+	);
+}
+
+static void
+update(Pager *pager)
+{
+	Cardinal i;
+	char *str;
+
+	/*
+	 * Event handlers do not fetch properties nor draw anything; they
+	 * only mark the pager and its clients as dirty.  This routine is
+	 * called once the event queue has been drained, and performs the
+	 * pending updates, so a burst of events (such as when the window
+	 * manager switches workspaces) costs a single redraw per object.
+	 */
+	if (pager->dirty & DIRTY_RESOURCES) {
+		str = gettextprop(
+			pager->display,
+			pager->root,
+			XA_RESOURCE_MANAGER,
+			False
+		);
+		if (str != NULL) {
+			loadresources(pager, str);
+			free(str);
+			fillcolors(pager);
+			pager->tilegen++;
+			pager->dirty |= DIRTY_GEOMETRY | DIRTY_PAGER;
+		}
+	}
+	if (pager->dirty & DIRTY_NDESKTOPS) {
+		setndesktops(pager);
+		pager->dirty |= DIRTY_GEOMETRY | DIRTY_CLIENTS | DIRTY_ACTIVE;
+	}
+	if (pager->dirty & DIRTY_GEOMETRY)
+		redrawall(pager);
+	if (pager->dirty & DIRTY_CLIENTS)
+		setclients(pager);
+	if (pager->dirty & DIRTY_ACTIVE)
+		setactive(pager);
+	if (pager->dirty & DIRTY_CURRDESK)
+		setcurrdesktop(pager);
+	if (pager->dirty & DIRTY_SHOWDESK)
+		setshowingdesk(pager);
+	if (pager->dirty & DIRTY_PAGER)
+		drawpager(pager);
+	if (pager->dirty & DIRTY_CLIENT) {
+		pager->due = 0;
+		reframeclients(pager);
+		for (i = 0; i < pager->nclients; i++)
+			if (pager->clients[i]->dirty)
+				updateclient(pager, pager->clients[i]);
+	}
+	pager->dirty = 0;
+	drawframe(pager);
+	if (pager->stats)
+		reportstats(pager);
+}
+
+static bool
+hittest(Pager *pager, int x, int y, Cardinal *desk, Client **cp)
+{
+	XRectangle *geometry, *minigeom;
+	Cardinal i, j;
+	int b;
+
+	/* find the desktop and the topmost client at a point of the pager */
+	b = pager->borders[BORDER_WIDTH];
+	x -= pager->borders[FRAME_WIDTH];
+	y -= pager->borders[FRAME_WIDTH];
+	for (i = 0; i < pager->ndesktops; i++) {
+		geometry = &pager->desktops[i].geometry;
+		if (!between(x, geometry->x, geometry->width))
+			continue;
+		if (!between(y, geometry->y, geometry->height))
+			continue;
+		*desk = i;
+		*cp = NULL;
+		for (j = pager->nclients; j > 0 && !pager->showingdesk; j--) {
+			if (!isatdesk(pager->clients[j - 1], i))
+				continue;
+			minigeom = &pager->clients[j - 1]->minigeoms[i];
+			if (!between(x - geometry->x, minigeom->x, minigeom->width + b * 2))
+				continue;
+			if (!between(y - geometry->y, minigeom->y, minigeom->height + b * 2))
+				continue;
+			*cp = pager->clients[j - 1];
+			break;
+		}
+		return true;
+	}
+	return false;
 }
 
 static void
 xeventbuttonpress(Pager *pager, XEvent *e)
 {
 	XButtonEvent *ev;
-	size_t i, j;
+	Entry *entry;
+	Client *cp;
+	Cardinal desk;
 
 	ev = &e->xbutton;
 	if (ev->button != Button1)
 		return;
-	for (i = 0; i < pager->ndesktops; i++) {
-		if (ev->window == pager->desktops[i].miniwin) {
-			clientmsg(
-				pager,
-				None,
-				pager->atoms[_NET_CURRENT_DESKTOP],
-				(Atom[]){i, CurrentTime, 0, 0, 0}
-			);
+	if (pager->composite) {
+		if (ev->window != pager->window)
 			return;
-		}
-	}
-	for (i = 0; i < pager->nclients; i++) {
-		if (pager->clients[i] == NULL)
-			continue;
-		for (j = 0; j < pager->ndesktops; j++) {
-			if (ev->window != pager->clients[i]->miniwins[j])
-				continue;
-			mousemove(
-				pager,
-				pager->clients[i],
-				ev->window,
-				ev->x,
-				ev->y,
-				ev->time
-			);
+		if (!hittest(pager, ev->x, ev->y, &desk, &cp))
+			return;
+	} else {
+		if ((entry = getentry(pager, ev->window)) == NULL)
+			return;
+		cp = entry->client;
+		desk = entry->desk;
+		if (cp != NULL && cp->clientwin == ev->window) {
 			return;
 		}
 	}
+	if (cp == NULL) {
+		clientmsg(
+			pager,
+			None,
+			pager->atoms[_NET_CURRENT_DESKTOP],
+			(Atom[]){desk, CurrentTime, 0, 0, 0}
+		);
+	} else {
+		mousemove(pager, cp, ev);
+	}
+}
+
+static void
+xeventexpose(Pager *pager, XEvent *e)
+{
+	XExposeEvent *ev;
+
+	ev = &e->xexpose;
+	if (!pager->composite || ev->window != pager->window)
+		return;
+	if (pager->backbuf == None)
+		return;
+	XCopyArea(
+		pager->display,
+		pager->backbuf,
+		pager->window,
+		pager->gc,
+		ev->x, ev->y,
+		ev->width, ev->height,
+		ev->x, ev->y
+	);
 }
 
 static void
@@ -1437,32 +3802,62 @@ xeventconfigurenotify(Pager *pager, XEvent *e)
 {
 	XConfigureEvent *ev;
 	Client *c;
-	Cardinal j;
+	int x, y;
 
 	ev = &e->xconfigure;
 	if (ev->window == pager->root) {
 		/* screen size changed (eg' a new monitor was plugged-in) */
 		pager->rootgeom.width = ev->width;
 		pager->rootgeom.height = ev->height;
-		redrawall(pager);
+		pager->dirty |= DIRTY_GEOMETRY;
 		return;
 	}
 	if (ev->window == pager->window) {
 		/* the pager window may have been resized */
 		setpagersize(pager, ev->width, ev->height);
-		redrawall(pager);
+		pager->dirty |= DIRTY_GEOMETRY;
 	}
 	if ((c = getclient(pager, ev->window)) != NULL) {
 		/* a client window window may have been moved or resized */
-		c->clientgeom.x = ev->x;
-		c->clientgeom.y = ev->y;
+		x = ev->x + ev->border_width;
+		y = ev->y + ev->border_width;
+		if (ev->send_event) {
+			/* synthetic events (from the WM) are relative to the root */
+			c->framex = x - c->offx;
+			c->framey = y - c->offy;
+		} else {
+			/* real events are relative to the parent */
+			c->offx += x - c->relx;
+			c->offy += y - c->rely;
+			c->relx = x;
+			c->rely = y;
+		}
 		c->clientgeom.width = ev->width;
 		c->clientgeom.height = ev->height;
-		for (j = 0; j < pager->ndesktops; j++)
-			configureclient(pager, j, c);
-		drawclient(pager, c);
-		mapclient(pager, c);
+	} else if ((c = getframeclient(pager, ev->window)) != NULL) {
+		/* the frame of a client window may have been moved or resized */
+		c->framex = ev->x + ev->border_width;
+		c->framey = ev->y + ev->border_width;
+	} else {
+		return;
 	}
+	c->clientgeom.x = c->framex + c->offx;
+	c->clientgeom.y = c->framey + c->offy;
+	markclient(pager, c, CLIENT_GEOMETRY);
+}
+
+static void
+xeventreparentnotify(Pager *pager, XEvent *e)
+{
+	XReparentEvent *ev;
+	Client *c;
+
+	/* a client window (or its frame) has been reparented */
+	ev = &e->xreparent;
+	if ((c = getclient(pager, ev->window)) == NULL &&
+	    (c = getframeclient(pager, ev->window)) == NULL)
+		return;
+	markclient(pager, c, CLIENT_FRAME | CLIENT_GEOMETRY | CLIENT_DRAW | CLIENT_MAP);
 }
 
 static void
@@ -1470,12 +3865,14 @@ xeventpropertynotify(Pager *pager, XEvent *e)
 {
 	Client *cp;
 	XPropertyEvent *ev;
-	char *str;
 
 	/*
 	 * This routine is called when the value of a property has been
 	 * reset. If a known property was detected to be the reset one,
-	 * its internal value is reset (with a set*() function).
+	 * the pager or the client is marked as dirty, and the new value
+	 * is only fetched (with a set*() function) by update() once the
+	 * event queue has been drained.  This way, a burst of events on
+	 * the same property costs a single fetch and a single redraw.
 	 *
 	 * Note that the value can by some reason not have changed, and
 	 * be equal to the previously stored one. In that case, the set
@@ -1490,69 +3887,99 @@ xeventpropertynotify(Pager *pager, XEvent *e)
 		return;
 	if (ev->atom == pager->atoms[_NET_CLIENT_LIST_STACKING]) {
 		/* the list of windows was reset */
-		setclients(pager);
-		setactive(pager);
+		pager->dirty |= DIRTY_CLIENTS | DIRTY_ACTIVE;
 	} else if (ev->atom == pager->atoms[_NET_ACTIVE_WINDOW]) {
 		/* the active window value was reset */
-		setactive(pager);
+		pager->dirty |= DIRTY_ACTIVE;
 	} else if (ev->atom == pager->atoms[_NET_CURRENT_DESKTOP]) {
 		/* the current desktop value was reset */
-		setcurrdesktop(pager);
+		pager->dirty |= DIRTY_CURRDESK;
 	} else if (ev->atom == pager->atoms[_NET_SHOWING_DESKTOP]) {
 		/* the value of the "showing desktop" state was reset */
-		setshowingdesk(pager);
+		pager->dirty |= DIRTY_SHOWDESK;
 	} else if (ev->atom == pager->atoms[_NET_NUMBER_OF_DESKTOPS]) {
 		/* the number of desktops value was reset */
-		setndesktops(pager);
-		setdeskgeom(pager);
-		drawdesktops(pager);
-		setclients(pager);
-		setactive(pager);
+		pager->dirty |= DIRTY_NDESKTOPS | DIRTY_CLIENTS | DIRTY_ACTIVE;
 	} else if (ev->atom == pager->atoms[_NET_WM_STATE]) {
 		/* the list of states of a window (which may or may not include a relevant state) was reset */
 		if ((cp = getclient(pager, ev->window)) == NULL)
 			return;
-		sethidden(pager, cp);
-		setdesktop(pager, cp);
-		seturgency(pager, cp);
-		drawclient(pager, cp);
-		mapclient(pager, cp);
+		markclient(pager, cp, CLIENT_STATE);
 	} else if (ev->atom == pager->atoms[_NET_WM_DESKTOP]) {
 		/* the desktop of a window was reset */
 		if ((cp = getclient(pager, ev->window)) == NULL)
 			return;
-		setdesktop(pager, cp);
-		mapclient(pager, cp);
+		markclient(pager, cp, CLIENT_DESKTOP);
 	} else if (ev->atom == XA_WM_HINTS) {
 		/* the urgency state of a window was reset */
 		if ((cp = getclient(pager, ev->window)) == NULL)
 			return;
-		seturgency(pager, cp);
-		drawclient(pager, cp);
+		markclient(pager, cp, CLIENT_HINTS);
 	} else if (ev->atom == pager->atoms[_NET_WM_ICON]) {
 		if ((cp = getclient(pager, ev->window)) == NULL)
 			return;
-		if (cp->icon != None)
-			XRenderFreePicture(pager->display, cp->icon);
-		cp->icon = geticonprop(pager, cp->clientwin);
-		drawclient(pager, cp);
+		markclient(pager, cp, CLIENT_ICON);
 	} else if (ev->atom == XA_RESOURCE_MANAGER) {
 		if (ev->window != pager->root)
 			return;
-		str = gettextprop(
-			pager->display,
-			pager->root,
-			XA_RESOURCE_MANAGER,
-			False
-		);
-		if (str == NULL)
-			return;
-		loadresources(pager, str);
-		free(str);
-		fillcolors(pager);
-		redrawall(pager);
-		drawpager(pager);
+		pager->dirty |= DIRTY_RESOURCES;
+	}
+}
+
+static bool
+waitevent(Pager *pager)
+{
+	struct pollfd pfds[2];
+	unsigned long curr;
+	int timeout;
+
+	/*
+	 * Wait for the next event or fetched icon, but no longer than the
+	 * earliest deferred client update.  Return false if there is
+	 * something to update before the next event.
+	 *
+	 * The round trips of the last update may have read events into
+	 * the queue of Xlib (or of XCB); the socket is empty then, so do
+	 * not poll it while events are queued.
+	 */
+	if (pager->populating) {
+		/*
+		 * Add the next batch of clients before waiting; but apply
+		 * the icons fetched meanwhile (the pipe does not block).
+		 */
+		if (pager->workerdpy != NULL)
+			readicons(pager);
+		pager->dirty |= DIRTY_CLIENTS | DIRTY_ACTIVE;
+		return false;
+	}
+	if (XPending(pager->display) > 0)
+		return true;
+	timeout = -1;
+	if (pager->due != 0) {
+		curr = now();
+		if (curr >= pager->due) {
+			pager->dirty |= DIRTY_CLIENT;
+			return false;
+		}
+		timeout = pager->due - curr;
+	}
+	pfds[0].fd = ConnectionNumber(pager->display);
+	pfds[0].events = POLLIN;
+	pfds[1].fd = (pager->workerdpy != NULL) ? pager->resfd[0] : -1;
+	pfds[1].events = POLLIN;
+	XFlush(pager->display);
+	switch (poll(pfds, 2, timeout)) {
+	case -1:
+		return true;
+	case 0:
+		pager->dirty |= DIRTY_CLIENT;
+		return false;
 	}
+	if (pfds[1].revents & POLLIN) {
+		readicons(pager);
+		return false;
+	}
+	return true;
 }
 
 static void
@@ -1561,8 +3988,27 @@ clean(Pager *pager)
 	size_t i;
 	Color *color;
 
+	if (pager->stats)
+		(void)fprintf(stderr, "%s: %lu redraws skipped\n", APP_NAME, pager->nskipped);
+	stopworker(pager);
 	cleanclients(pager);
 	cleandesktops(pager);
+	while (pager->icons != NULL)
+		evicticon(pager, pager->icons);
+	cleanshm(pager);
+	if (pager->diskcache != NULL)
+		(void)munmap(pager->diskcache, sizeof(*pager->diskcache));
+	purgetiles(pager, true);
+	free(pager->entries);
+	if (pager->backpic != None)
+		XRenderFreePicture(pager->display, pager->backpic);
+	if (pager->backbuf != None)
+		XFreePixmap(pager->display, pager->backbuf);
+	if (pager->gc != NULL)
+		XFreeGC(pager->display, pager->gc);
+	for (i = 0; i < NSCHEMES; i++)
+		if (pager->frames[i] != None)
+			XRenderFreePicture(pager->display, pager->frames[i]);
 	for (i = 0; i < NCOLORS; i++) {
 		color = &pager->colors[i];
 		if (color->picture != None)
@@ -1570,10 +4016,13 @@ clean(Pager *pager)
 		if (color->pixmap != None)
 			XFreePixmap(pager->display, color->pixmap);
 	}
-	if (pager->icon != None)
-		XRenderFreePicture(pager->display, pager->icon);
-	if (pager->mask != None)
-		XRenderFreePicture(pager->display, pager->mask);
+	free(pager->slots);
+	if (pager->atlaspic != None)
+		XRenderFreePicture(pager->display, pager->atlaspic);
+	if (pager->atlas != None)
+		XFreePixmap(pager->display, pager->atlas);
+	if (pager->atlasgc != NULL)
+		XFreeGC(pager->display, pager->atlasgc);
 	if (pager->window != None)
 		XDestroyWindow(pager->display, pager->window);
 	XCloseDisplay(pager->display);
@@ -1603,15 +4052,19 @@ setup(Pager *pager, int argc, char *argv[], char *name, char *geomstr)
 	XRenderPictFormat *maskformat;
 	Pixmap icon = None;
 	Pixmap mask = None;
+	Picture iconpic, maskpic;
 	Resource *resource;
 	Color *color;
 	size_t i;
 	int success, status, screen;
+	bool threads;
 
+	pager->starttime = now();
 	if (name == NULL)
 		name = APP_NAME;
 
 	/* connect to server */
+	threads = XInitThreads();
 	if ((pager->display = XOpenDisplay(NULL)) == NULL) {
 		warnx("could not connect to X server");
 		goto error;
@@ -1680,6 +4133,8 @@ setup(Pager *pager, int argc, char *argv[], char *name, char *geomstr)
 			};
 		} else if (i < NCOLORS + NBORDERS) {
 			pager->borders[i-NCOLORS] = resdefs[i].value;
+		} else if (i < NCOLORS + NBORDERS + NSETTINGS) {
+			pager->settings[i-NCOLORS-NBORDERS] = resdefs[i].value;
 		} else if (i == RES_GEOMETRY) {
 			pager->geometry.width = resdefs[i].value;
 			pager->geometry.height = resdefs[i].value;
@@ -1748,6 +4203,21 @@ setup(Pager *pager, int argc, char *argv[], char *name, char *geomstr)
 		);
 	}
 	fillcolors(pager);
+	if (pager->composite) {
+		XSelectInput(
+			pager->display,
+			pager->window,
+			StructureNotifyMask | ExposureMask | ButtonPressMask
+		);
+		pager->gc = XCreateGC(
+			pager->display,
+			pager->window,
+			GCGraphicsExposures,
+			&(XGCValues){
+				.graphics_exposures = False,
+			}
+		);
+	}
 
 	/* set window size and properties */
 	XMoveResizeWindow(
@@ -1802,32 +4272,54 @@ setup(Pager *pager, int argc, char *argv[], char *name, char *geomstr)
 		warnx("could not load xpm");
 		goto error;
 	}
-	pager->icon = XRenderCreatePicture(
+	iconpic = XRenderCreatePicture(
 		pager->display,
 		icon,
 		pager->format,
 		0, NULL
 	);
-	pager->mask = XRenderCreatePicture(
+	maskpic = XRenderCreatePicture(
 		pager->display,
 		mask,
 		maskformat,
 		0, NULL
 	);
+	resizeatlas(pager, ATLASCOLS);
+	initshm(pager);
+	opendiskcache(pager);
+	if (threads)
+		startworker(pager);
+	XRenderComposite(
+		pager->display,
+		PictOpSrc,
+		iconpic, maskpic, pager->atlaspic,
+		0, 0, 0, 0,
+		SLOTX(0), SLOTY(0),
+		ICON_SIZE, ICON_SIZE
+	);
+	XRenderFreePicture(pager->display, iconpic);
+	XRenderFreePicture(pager->display, maskpic);
 	XFreePixmap(pager->display, icon);
 	XFreePixmap(pager->display, mask);
 
 	/* get clients and desktops */
+	/*
+	 * Map the pager with the desktops only; clients are added in
+	 * batches by the event loop (see setclients()).
+	 */
 	setndesktops(pager);
 	setdeskgeom(pager);
 	setcurrdesktop(pager);
-	setclients(pager);
-	setactive(pager);
 	drawdesktops(pager);
 	drawpager(pager);
-	mapclients(pager);
+	drawframe(pager);
+	pager->dirty |= DIRTY_CLIENTS | DIRTY_ACTIVE;
 
 	XMapWindow(pager->display, pager->window);
+	if (pager->stats) {
+		XSync(pager->display, False);
+		pager->painttime = now();
+	}
 	return;
 error:
 	if (icon != None)
@@ -1928,8 +4420,10 @@ main(int argc, char *argv[])
 	void (*xevents[LASTEvent])(Pager *, XEvent *) = {
 		[ButtonPress]           = xeventbuttonpress,
 		[ConfigureNotify]       = xeventconfigurenotify,
+		[Expose]                = xeventexpose,
 		[ClientMessage]         = xeventclientmessage,
 		[PropertyNotify]        = xeventpropertynotify,
+		[ReparentNotify]        = xeventreparentnotify,
 	};
 	char *name;
 	char *geometry;
@@ -1955,6 +4449,8 @@ main(int argc, char *argv[])
 			pager.xrm = argv[++i];
 		} else if (strcmp(argv[i], "-geometry") == 0) {
 			geometry = argv[++i];
+		} else if (strcmp(argv[i], "-stats") == 0) {
+			pager.stats = true;
 		} else if (strcmp(argv[i], "--")) {
 			i++;
 			break;
@@ -1975,9 +4471,17 @@ main(int argc, char *argv[])
 
 	setup(&pager, argc, argv, name, geometry);
 	pager.running = true;
-	while (pager.running && !XNextEvent(pager.display, &ev))
+	while (pager.running) {
+		if (XPending(pager.display) == 0) {
+			update(&pager);
+			if (!waitevent(&pager))
+				continue;
+		}
+		if (XNextEvent(pager.display, &ev))
+			break;
 		if (ev.type < LASTEvent && xevents[ev.type] != NULL)
 			(*xevents[ev.type])(&pager, &ev);
+	}
 	clean(&pager);
 	return EXIT_SUCCESS;
 }